@@ -6,6 +6,22 @@ import * as builder_pb from './builder_pb';
 
 export type WorkerAddr = number;
 
+/** Entry of worker log site table, generated by worker/gen_log_table.py. */
+export interface LogSite {
+    file: string;
+    line: number;
+    criticality: string;
+    cause: string;
+    message: string;
+    args: Array<string>;
+}
+
+export interface LogRecord {
+    site?: LogSite;
+    siteId: number;
+    args: Array<number>;
+}
+
 export interface Packet {
     raw_data: any;
 
@@ -29,6 +45,11 @@ export class WorkerBridge {
     private handlePacket?: (packet: Packet) => void;
 
     logPath = './state/packet_log';
+    logTablePath = '../worker/build/log_table.json';
+    private logSites: Map<number, LogSite> = new Map();
+
+    // Largest packet (excluding checksum) that fits in worker's receive buffer.
+    private static readonly MAX_PACKET_SIZE = 118;
 
     constructor(private fakePath?: string) {
         let testpb = Uint8Array.from([18, 2, 98, 106]);
@@ -36,6 +57,96 @@ export class WorkerBridge {
         let msg = builder_pb.I2CScanResult.deserializeBinary(testpb);
         console.log(msg, msg.getType(), msg.getDeviceList(), msg.toObject());
         this.path = this.findDevice();
+        this.loadLogTable();
+    }
+
+    private loadLogTable() {
+        fs.readFile(this.logTablePath, "utf8", (err, data) => {
+            if (err) {
+                console.warn('log table not found; LOG packets will not be decoded', err);
+                return;
+            }
+            const sites = JSON.parse(data).sites;
+            Object.keys(sites).forEach(id => this.logSites.set(parseInt(id), sites[id]));
+        });
+    }
+
+    getLogSite(siteId: number): LogSite | undefined {
+        return this.logSites.get(siteId);
+    }
+
+    /**
+     * Decode LOG datagram. Argument layout is known only by site table,
+     * so decoding stops at the first unknown site.
+     */
+    private decodeLog(datagram: Uint8Array): any {
+        const view = new DataView(datagram.buffer, datagram.byteOffset, datagram.byteLength);
+        const argSizes = { u8: 1, i8: 1, u16: 2, i16: 2, u32: 4, i32: 4 };
+        let records: Array<LogRecord> = [];
+        let ofs = 1;
+        while (ofs + 2 <= view.byteLength) {
+            const siteId = view.getUint16(ofs, true);
+            ofs += 2;
+            const site = this.logSites.get(siteId);
+            if (site === undefined) {
+                records.push({ siteId: siteId, args: [] });
+                break;
+            }
+            let args = [];
+            for (let ty of site.args) {
+                if (ofs + argSizes[ty] > view.byteLength) {
+                    break;
+                }
+                switch (ty) {
+                    case 'u8': args.push(view.getUint8(ofs)); break;
+                    case 'i8': args.push(view.getInt8(ofs)); break;
+                    case 'u16': args.push(view.getUint16(ofs, true)); break;
+                    case 'i16': args.push(view.getInt16(ofs, true)); break;
+                    case 'u32': args.push(view.getUint32(ofs, true)); break;
+                    case 'i32': args.push(view.getInt32(ofs, true)); break;
+                }
+                ofs += argSizes[ty];
+            }
+            records.push({ site: site, siteId: siteId, args: args });
+        }
+        return {
+            numDropped: view.byteLength > 0 ? view.getUint8(0) : 0,
+            records: records,
+        };
+    }
+
+    /** Decode BEACON datagram (layout in worker/README.md). */
+    private decodeBeacon(datagram: Uint8Array): any {
+        const view = new DataView(datagram.buffer, datagram.byteOffset, datagram.byteLength);
+        if (view.byteLength < 9) {
+            return null;
+        }
+        const flags = view.getUint8(0);
+        return {
+            execStatus: flags & 3,
+            held: (flags & 4) !== 0,
+            jogging: (flags & 8) !== 0,
+            program: (flags & 16) !== 0,
+            severe: (flags & 32) !== 0,
+            runningSeq: view.getUint16(1, true),
+            lastSeq: view.getUint16(3, true),
+            queueFree: view.getUint8(5),
+            batMv: view.getUint8(6) * 32,
+            numErrorTotal: view.getUint16(7, true),
+        };
+    }
+
+    /** Decode EMERGENCY_ACK datagram (layout in worker/README.md). */
+    private decodeEmergencyAck(datagram: Uint8Array): any {
+        const view = new DataView(datagram.buffer, datagram.byteOffset, datagram.byteLength);
+        if (view.byteLength < 5) {
+            return null;
+        }
+        return {
+            op: String.fromCharCode(view.getUint8(0)),
+            preemptedSeq: view.getUint16(1, true),
+            latencyUs: view.getUint16(3, true),
+        };
     }
 
     open(handleUpdate: (br: WorkerBridge) => void, handlePacket: (packet: Packet) => void): void {
@@ -108,10 +219,18 @@ export class WorkerBridge {
                 const type_map = new Map();
                 type_map.set(builder_pb.PacketType.CHECKPOINT, builder_pb.Checkpoint);
                 type_map.set(builder_pb.PacketType.STATUS, builder_pb.Status);
+                type_map.set(builder_pb.PacketType.STATUS_REPORT, builder_pb.StatusReport);
                 type_map.set(builder_pb.PacketType.IO_STATUS, builder_pb.IOStatus);
                 type_map.set(builder_pb.PacketType.I2C_SCAN_RESULT, builder_pb.I2CScanResult);
+                type_map.set(builder_pb.PacketType.ERROR_COUNTERS, builder_pb.ErrorCounters);
 
-                if (type_map.has(packet.ty)) {
+                if (packet.ty === builder_pb.PacketType.LOG) {
+                    packet.data = this.decodeLog(packet.datagram);
+                } else if (packet.ty === builder_pb.PacketType.BEACON) {
+                    packet.data = this.decodeBeacon(packet.datagram);
+                } else if (packet.ty === builder_pb.PacketType.EMERGENCY_ACK) {
+                    packet.data = this.decodeEmergencyAck(packet.datagram);
+                } else if (type_map.has(packet.ty)) {
                     packet.data = type_map.get(packet.ty).deserializeBinary(packet.datagram).toObject();
                 } else {
                     console.error("Unknown PacketType=", packet.ty);
@@ -142,6 +261,72 @@ export class WorkerBridge {
         this.port.write(final_command);
     }
 
+    /**
+     * Send different commands to multiple workers, in as few packets as possible.
+     * Identical commands are stored only once in each packet's payload.
+     * Throws (before sending anything) if a single command can't fit in a packet.
+     */
+    sendMulticastCommand(commands: Map<WorkerAddr, string>): void {
+        let packets: Array<ArrayBuffer> = [];
+        let group: Array<[WorkerAddr, string]> = [];
+        commands.forEach((command, addr) => {
+            if (WorkerBridge.multicastPacketSize([[addr, command]]) > WorkerBridge.MAX_PACKET_SIZE) {
+                throw new Error(`Multicast command for ${addr} too long (${command.length} chars)`);
+            }
+            if (WorkerBridge.multicastPacketSize(group.concat([[addr, command]])) > WorkerBridge.MAX_PACKET_SIZE) {
+                packets.push(WorkerBridge.encodeMulticastPacket(group));
+                group = [];
+            }
+            group.push([addr, command]);
+        });
+        if (group.length > 0) {
+            packets.push(WorkerBridge.encodeMulticastPacket(group));
+        }
+
+        packets.forEach(buffer => {
+            let final_command = ':' + encodeHex(buffer) + 'X\r\n';
+            this.port.write(final_command);
+        });
+    }
+
+    private static multicastPacketSize(commands: Array<[WorkerAddr, string]>): number {
+        const payloadSize = Array.from(new Set(commands.map(([_, command]) => command)))
+            .reduce((acc, command) => acc + command.length, 0);
+        return 2 + 4 + 1 + 6 * commands.length + payloadSize;
+    }
+
+    /** precondition: multicastPacketSize(commands) <= MAX_PACKET_SIZE (so all offsets / lengths fit in uint8) */
+    private static encodeMulticastPacket(commands: Array<[WorkerAddr, string]>): ArrayBuffer {
+        let sections: Array<string> = [];
+        let table: Array<[WorkerAddr, number]> = [];
+        commands.forEach(([addr, command]) => {
+            let ix = sections.indexOf(command);
+            if (ix < 0) {
+                ix = sections.length;
+                sections.push(command);
+            }
+            table.push([addr, ix]);
+        });
+        const offsets = sections.map((_, ix) => sections.slice(0, ix).reduce((acc, sec) => acc + sec.length, 0));
+        const payload = sections.join('');
+
+        const tableSize = 1 + 6 * table.length;
+        let buffer = new ArrayBuffer(2 + 4 + tableSize + payload.length);
+        let header = new DataView(buffer);
+        header.setUint8(0, 0x78); // TWELITE addr: default child
+        header.setUint8(1, 0x01); // TWELITE command: Serial
+        header.setUint32(2, 0xfffffffe); // OVM addr: multicast
+        header.setUint8(6, table.length);
+        table.forEach(([addr, ix], i) => {
+            header.setUint32(7 + 6 * i, addr);
+            header.setUint8(7 + 6 * i + 4, offsets[ix]);
+            header.setUint8(7 + 6 * i + 5, sections[ix].length);
+        });
+        let body = new Uint8Array(buffer, 2 + 4 + tableSize);
+        body.set(Array.from(payload).map(ch => ch.charCodeAt(0)));
+        return buffer;
+    }
+
     /** @returns human-readable short text describing mode */
     getMode(): string {
         if (this.isOpen) {
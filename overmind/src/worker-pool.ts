@@ -1,6 +1,6 @@
 import * as Identicon from 'identicon.js';
 import * as md5 from 'md5';
-import { Packet } from './comm';
+import { Packet, LogRecord } from './comm';
 import { ActionSeq } from './action';
 import { WorkerAddr, WorkerBridge } from './comm';
 import * as fs from 'fs';
@@ -26,6 +26,11 @@ interface Worker {
 
     i2c_scan_result_time: Date;
     i2c_scan_result_cont: any;
+
+    beacon_time?: Date;
+    beacon_cont?: any;
+    emergency_ack_time?: Date;
+    emergency_ack_cont?: any;
 }
 
 interface WorkerEntry {
@@ -72,6 +77,77 @@ export class WorkerPool {
         this.bridge.sendCommand('e' + asq.getFullDesc(), addr);
     }
 
+    /** Send ActionSeqs to multiple workers in as few multicast packets as possible. */
+    sendActionSeqs(asqs: Map<WorkerAddr, ActionSeq>) {
+        let commands = new Map<WorkerAddr, string>();
+        asqs.forEach((asq, addr) => commands.set(addr, 'e' + asq.getFullDesc()));
+        this.bridge.sendMulticastCommand(commands);
+    }
+
+    /**
+     * Store action list (with "$0"~"$3" argument slots) as macro in worker EEPROM.
+     * Invoke it as "x<id>(<arg>;...)" in place of an Action.
+     */
+    defineMacro(id: number, body: string, addr: WorkerAddr) {
+        this.bridge.sendCommand('d' + id + ':' + body, addr);
+    }
+
+    /**
+     * Upload actions (same format as enqueue) as shadow plan, to be started by swapPlan.
+     */
+    enqueueShadow(actions: string, addr: WorkerAddr) {
+        this.bridge.sendCommand('n' + actions, addr);
+    }
+
+    /**
+     * Swap to shadow plan now, or when action afterSeq finishes.
+     */
+    swapPlan(addr: WorkerAddr, afterSeq?: number) {
+        this.bridge.sendCommand('w' + (afterSeq === undefined ? '' : afterSeq), addr);
+    }
+
+    /**
+     * Edit queued actions by seq (op: 't' truncate after, 'r' replace, 'i' insert before). See worker/README.md.
+     */
+    editQueue(op: 't' | 'r' | 'i', seq: number, action: string, addr: WorkerAddr) {
+        this.bridge.sendCommand('q' + op + seq + (op === 't' ? '' : ':' + action), addr);
+    }
+
+    /**
+     * Query status fields selected by mask (see StatusReport in builder.proto). All fields if omitted.
+     */
+    printStatus(addr: WorkerAddr, mask?: number) {
+        this.bridge.sendCommand('p' + (mask === undefined ? '' : mask), addr);
+    }
+
+    /**
+     * Make worker send BEACON every periodMs (0 disables).
+     */
+    configBeacon(periodMs: number, addr: WorkerAddr) {
+        this.bridge.sendCommand('b' + periodMs, addr);
+    }
+
+    /**
+     * Stream jog setpoints (e.g. "t40o-10"). Call at 10~50Hz; jogged motors stop after deadman window.
+     */
+    jog(setpoints: string, addr: WorkerAddr) {
+        this.bridge.sendCommand('j' + setpoints, addr);
+    }
+
+    /**
+     * Emergency command (op: 's' STOP, 'c' CLEAR, 'h' HOLD, 'r' RESUME). Handled by worker RX ISR.
+     */
+    emergency(op: 's' | 'c' | 'h' | 'r', addr: WorkerAddr) {
+        this.bridge.sendCommand('!' + op, addr);
+    }
+
+    /**
+     * Run bytecode program (see worker/README.md) on worker. Empty program stops it.
+     */
+    runProgram(bytes: number[], addr: WorkerAddr) {
+        this.bridge.sendCommand('g' + String.fromCharCode(...bytes), addr);
+    }
+
     handleDatagram(packet: Packet) {
         if (packet.src === 0) {
             this.lastUninit = new Date();
@@ -125,6 +201,8 @@ export class WorkerPool {
 
             worker.status_time = new Date();
             worker.status_cont = data;
+        } else if (packet.ty === builder_pb.PacketType.STATUS_REPORT) {
+            this.handleStatusReport(worker, data);
         } else if (packet.ty === builder_pb.PacketType.I2C_SCAN_RESULT) {
             worker.i2c_scan_result_time = new Date();
             worker.i2c_scan_result_cont = data;
@@ -139,11 +217,44 @@ export class WorkerPool {
             this.hackWorldView.accVector.position.copy(gVector);
         } else if (packet.ty === builder_pb.PacketType.CHECKPOINT) {
             this.handleCheckpoint(worker, packet, data);
+        } else if (packet.ty === builder_pb.PacketType.LOG) {
+            this.handleLog(worker, packet, data);
+        } else if (packet.ty === builder_pb.PacketType.ERROR_COUNTERS) {
+            this.handleErrorCounters(worker, packet, data);
+        } else if (packet.ty === builder_pb.PacketType.BEACON) {
+            worker.beacon_time = new Date();
+            worker.beacon_cont = data;
+        } else if (packet.ty === builder_pb.PacketType.EMERGENCY_ACK) {
+            worker.emergency_ack_time = new Date();
+            worker.emergency_ack_cont = data;
         } else {
             console.error("Unhandled packet type", packet.ty);
         }
     }
 
+    /** Merge (partial) StatusReport into status_cont & io_status_cont. */
+    private handleStatusReport(worker: Worker, data: any) {
+        worker.wtype = this.workerTypeMapping[data.workerType];
+        if (data.system || data.exec || data.queue || data.counters || data.link) {
+            worker.status_time = new Date();
+            worker.status_cont = Object.assign({}, worker.status_cont, {
+                workerType: data.workerType,
+                system: data.system || (worker.status_cont && worker.status_cont.system),
+                exec: data.exec || (worker.status_cont && worker.status_cont.exec),
+                queue: data.queue || (worker.status_cont && worker.status_cont.queue),
+                counters: data.counters || (worker.status_cont && worker.status_cont.counters),
+                link: data.link || (worker.status_cont && worker.status_cont.link),
+            });
+        }
+        if (data.sensor || data.output) {
+            worker.io_status_time = new Date();
+            worker.io_status_cont = Object.assign({}, worker.io_status_cont, {
+                sensor: data.sensor || (worker.io_status_cont && worker.io_status_cont.sensor),
+                output: data.output || (worker.io_status_cont && worker.io_status_cont.output),
+            });
+        }
+    }
+
     private handleCheckpoint(worker: Worker, packet: Packet, data: builder_pb.Checkpoint) {
         const critName = enumNameOf(data.criticality, builder_pb.Criticality);
         let message: any = {
@@ -154,4 +265,58 @@ export class WorkerPool {
         };
         worker.messages.unshift(message);
     }
+
+    private handleErrorCounters(worker: Worker, packet: Packet, data: any) {
+        data.counterList.forEach(counter => {
+            const site = this.bridge.getLogSite(counter.siteId);
+            const head = site ? `${site.criticality}:L${site.line}@${site.file}` : `UNKNOWN:#${counter.siteId}`;
+            const desc = site ? `${site.cause} ${site.message}` : '';
+            worker.messages.unshift({
+                status: site ? 'known' : 'corrupt',
+                head: `${head} x${counter.count}`,
+                desc: desc,
+                timestamp: packet.srcTs / 1e3,
+            });
+        });
+        if (data.numOverflow > 0) {
+            worker.messages.unshift({
+                status: 'corrupt',
+                head: `ERROR COUNTER OVERFLOW x${data.numOverflow}`,
+                desc: `${data.numTotal} errors in total`,
+                timestamp: packet.srcTs / 1e3,
+            });
+        }
+    }
+
+    private handleLog(worker: Worker, packet: Packet, data: any) {
+        data.records.forEach((record: LogRecord) => {
+            let message: any;
+            if (record.site === undefined) {
+                message = {
+                    status: 'corrupt',
+                    head: `UNKNOWN:#${record.siteId}`,
+                    desc: 'log site not found in table; worker/build/log_table.json may be stale',
+                    timestamp: packet.srcTs / 1e3,
+                };
+            } else {
+                const site = record.site;
+                let argIx = 0;
+                message = {
+                    status: 'known',
+                    head: `${site.criticality}:L${site.line}@${site.file}`,
+                    desc: `${site.cause} ${site.message.replace(/\{=[a-z0-9]+\}/g, () => String(record.args[argIx++]))}`,
+                    timestamp: packet.srcTs / 1e3,
+                };
+            }
+            worker.messages.unshift(message);
+        });
+        if (data.numDropped > 0) {
+            worker.messages.unshift({
+                status: 'corrupt',
+                head: 'LOG DROPPED',
+                desc: `${data.numDropped} records dropped`,
+                timestamp: packet.srcTs / 1e3,
+            });
+        }
+    }
 }
@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Generate host-side string table of worker log sites (see src/logging.h).
+
+usage: gen_log_table.py <output json> <source files...>
+"""
+import json
+import os
+import re
+import sys
+
+SITE_RE = re.compile(r'^\s*TWELITE_(INFO|ERROR|SEVERE)\((.*)\);\s*(?://\s*(.*))?$')
+PLACEHOLDER_RE = re.compile(r'\{=(u8|i8|u16|i16|u32|i32)\}')
+
+
+def site_id(path, line):
+    """Must be kept in sync with log_site_id() in src/logging.h"""
+    h = 2166136261
+    for c in os.path.basename(path).encode('ascii'):
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    h = ((h ^ (line & 0xff)) * 16777619) & 0xffffffff
+    h = ((h ^ (line >> 8)) * 16777619) & 0xffffffff
+    return (h >> 16) ^ (h & 0xffff)
+
+
+def split_args(args):
+    """Split macro arguments at top-level commas."""
+    result = []
+    depth = 0
+    current = ''
+    for c in args:
+        if c in '([{':
+            depth += 1
+        elif c in ')]}':
+            depth -= 1
+        if c == ',' and depth == 0:
+            result.append(current.strip())
+            current = ''
+        else:
+            current += c
+    if current.strip():
+        result.append(current.strip())
+    return result
+
+
+def parse_sites(path):
+    sites = []
+    with open(path) as f:
+        for (ix, text) in enumerate(f):
+            m = SITE_RE.match(text)
+            if m is None:
+                continue
+            (criticality, args, message) = m.groups()
+            args = split_args(args)
+            cause = 'LOGIC'
+            if criticality != 'INFO':
+                cause = args.pop(0)[len('Cause_'):]
+            message = message or ''
+            layout = PLACEHOLDER_RE.findall(message)
+            if len(layout) != len(args):
+                raise Exception('%s:%d: %d args given, but message has %d placeholders' %
+                                (path, ix + 1, len(args), len(layout)))
+            sites.append({
+                'id': site_id(path, ix + 1),
+                'file': os.path.basename(path),
+                'line': ix + 1,
+                'criticality': criticality,
+                'cause': cause,
+                'message': message,
+                'args': layout,
+            })
+    return sites
+
+
+def main():
+    out_path = sys.argv[1]
+    table = {}
+    for path in sys.argv[2:]:
+        for site in parse_sites(path):
+            key = str(site['id'])
+            if key in table:
+                prev = table[key]
+                if (prev['file'], prev['line']) == (site['file'], site['line']):
+                    continue
+                raise Exception('Log site ID collision: %s:%d and %s:%d. Move one of them.' %
+                                (prev['file'], prev['line'], site['file'], site['line']))
+            table[key] = site
+    with open(out_path, 'w') as f:
+        json.dump({'sites': table}, f, indent=2, sort_keys=True)
+
+
+if __name__ == '__main__':
+    main()
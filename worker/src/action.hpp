@@ -1,34 +1,83 @@
 #pragma once
 
 #include <I2C.h>
+#include <avr/eeprom.h>
 #include <proto/builder.pb.h>
 
+#include "beacon.hpp"
+#include "eeprom_layout.h"
+#include "motion_profile.hpp"
+#include "motor_ramp.hpp"
 #include "shared_state.h"
+#include "spline.hpp"
+#include "tx_scheduler.h"
 
-// Safely calculate va + (vb - va) * (ix / num)
-uint8_t interp(uint8_t va, uint8_t vb, uint8_t ix, uint8_t num) {
-  uint8_t delta = (vb > va) ? vb - va : va - vb;
-  uint8_t dv = (static_cast<uint16_t>(delta) * ix) / num;
-  return (vb > va) ? va + dv : va - dv;
-}
+// Actions in different lanes run in parallel, each lane with its own queue.
+// Lanes are named after what they usually drive, but any lane can drive any
+// actuator. Lanes must not drive the same actuator at the same time.
+enum LaneIx : uint8_t {
+  LANE_LOCO,
+  LANE_SERVO_A,
+  LANE_SERVO_B,
+  LANE_SCREW,
+  N_LANES
+};
 
 class Action {
  public:
+  // LaneIx to execute this action in.
+  uint8_t lane = LANE_LOCO;
+
+  // Bitmask of lanes to start together with. Non-zero means the action
+  // waits until all lanes in the mask are waiting at sync actions too, and
+  // they all start in the same tick.
+  uint8_t sync_mask = 0;
+
   // Set train=0 when sensor reading > this value.
   // 255 means disable this functionality.
   uint8_t train_cutoff_thresh = 255;
 
+  // Set train=0 when this many rail markers are passed.
+  // 255 means disable this functionality.
+  uint8_t train_stop_markers = 255;
+
+  // Set train=0 when fused rail position moved this much (in 1/256 segments)
+  // from the beginning of the action. Sign denotes direction.
+  const static int16_t TRAIN_STOP_POS_NONE = INT16_MIN;
+  int16_t train_stop_pos_delta = TRAIN_STOP_POS_NONE;
+
   // Note this can be 0, but action still has effect.
   uint16_t duration_step;
 
-  const static uint8_t SERVO_POS_KEEP = 0xff;
-  // 20~100
-  uint8_t servo_pos[N_SERVOS];
+  // Pulse width in us. ServoPWM::{MIN,MAX}_PULSE_US
+  const static uint16_t SERVO_POS_KEEP = 0xffff;
+  uint16_t servo_pos[N_SERVOS];
+
+  // How servos move to servo_pos during the action.
+  MotionProfile::Shape servo_shape = MotionProfile::SHAPE_LINEAR;
 
   // -0x7f~0x7f (max CCW~max CW), 0x80: keep
   const static int8_t MOTOR_VEL_KEEP = 0x80;
   int8_t motor_vel[N_MOTORS];
 
+  // Optional keyframe spline of one actuator, which overrides servo_pos /
+  // motor_vel of it. Keyframes live in ActionExecutorSingleton::keyframes.
+  // Target: servo index, or N_SERVOS + motor index.
+  const static uint8_t MAX_KEYFRAMES = 8;
+  uint8_t spline_target = 0;
+  uint8_t spline_begin = 0;
+  uint8_t spline_num_frames = 0;
+
+  // Assigned by ActionExecutorSingleton::enqueue. Wraps around, skipping
+  // SEQ_NONE.
+  const static uint16_t SEQ_NONE = 0;
+  uint16_t seq = SEQ_NONE;
+
+  // Plan generation, assigned by ActionExecutorSingleton::enqueue. Actions of
+  // the shadow (next) plan wait until swap, and ones of older plans are
+  // dropped.
+  uint8_t plan = 0;
+
   Action() : Action(0) {}
 
   Action(uint16_t duration_ms) : duration_step(duration_ms) {
@@ -39,10 +88,81 @@ class Action {
       motor_vel[i] = MOTOR_VEL_KEEP;
     }
   }
+
+  // Set single-value Target (see worker/README.md). Value is clamped to the
+  // valid range of the target. Returns false for unknown target.
+  bool set_target(char target, int16_t value) {
+    switch (target) {
+      case 'a':
+      case 'b':
+        servo_pos[(target == 'a') ? CIX_A : CIX_B] =
+            ServoPWM::legacy_pos_to_us(clamp(target, value, 10, 33));
+        break;
+      case 'A':
+      case 'B':
+        servo_pos[(target == 'A') ? CIX_A : CIX_B] =
+            clamp(target, value, ServoPWM::MIN_PULSE_US,
+                  ServoPWM::MAX_PULSE_US);
+        break;
+      case 'C':
+        servo_shape = static_cast<MotionProfile::Shape>(
+            clamp(target, value, 0, MotionProfile::NUM_SHAPES - 1));
+        break;
+      case 't':
+        motor_vel[MV_TRAIN] = clamp(target, value, -127, 127);
+        break;
+      case 'o':
+        motor_vel[MV_ORI] = clamp(target, value, -127, 127);
+        break;
+      case 's':
+        motor_vel[MV_SCREW_DRIVER] = clamp(target, value, -127, 127);
+        break;
+      case 'T':
+        train_cutoff_thresh = clamp(target, value, 0, 255);
+        break;
+      case 'M':
+        train_stop_markers = clamp(target, value, 0, 255);
+        break;
+      case 'P':
+        train_stop_pos_delta = value;
+        break;
+      case 'L':
+        lane = clamp(target, value, 0, N_LANES - 1);
+        break;
+      case 'W':
+        sync_mask = clamp(target, value, 0, (1 << N_LANES) - 1);
+        break;
+      default:
+        return false;
+    }
+    return true;
+  }
+
+  bool has_train_stop() const {
+    return train_cutoff_thresh != 255 || train_stop_markers != 255 ||
+           train_stop_pos_delta != TRAIN_STOP_POS_NONE;
+  }
+
+ private:
+  static int16_t clamp(char target, int16_t value, int16_t lo, int16_t hi) {
+    if (value < lo) {
+      TWELITE_ERROR(Cause_OVERMIND, target, value);  // too small {=u8}: {=i16}
+      return lo;
+    } else if (value > hi) {
+      TWELITE_ERROR(Cause_OVERMIND, target, value);  // too big {=u8}: {=i16}
+      return hi;
+    }
+    return value;
+  }
 };
 
 // ActionExecState = Zero | Executing
 class ActionExecState {
+ public:
+  // Servo profiles are advanced every PROFILE_STEP_MS. Servo output only
+  // updates every 20ms frame anyway.
+  static constexpr uint8_t PROFILE_STEP_MS = 4;
+
  private:
   // Nullable current action being executed.
   const Action* action;
@@ -50,30 +170,50 @@ class ActionExecState {
   // Don't care when action is null.
   uint16_t elapsed_step;
 
-  uint8_t servo_pos_pre[N_SERVOS];
+  // Valid only when action has spline_num_frames > 0.
+  HermiteSpline spline;
+
+  // Absolute rail position to stop train at. Valid only when action has
+  // train_stop_pos_delta.
+  int16_t train_stop_pos;
+
+  // Set when train stop condition was met in the last step.
+  bool train_stop_triggered = false;
 
  public:
   ActionExecState() : action(NULL) {}
 
-  ActionExecState(const Action* action, const uint8_t* servo_pos)
+  // Servo profiles are begun by the caller (see num_profile_steps).
+  ActionExecState(const Action* action, const uint16_t* servo_pos,
+                  const int8_t* motor_vel, const KeyframePool& keyframes)
       : action(action), elapsed_step(0) {
-    for (int i = 0; i < N_SERVOS; i++) {
-      servo_pos_pre[i] = servo_pos[i];
+    if (action == NULL) {
+      return;
+    }
+    if (action->spline_num_frames > 0) {
+      const uint8_t t = action->spline_target;
+      const int16_t v = (t < N_SERVOS) ? servo_pos[t] : motor_vel[t - N_SERVOS];
+      spline.begin_curve(keyframes, action->spline_begin,
+                         action->spline_num_frames, v);
+    }
+    if (action->train_stop_pos_delta != Action::TRAIN_STOP_POS_NONE) {
+      train_stop_pos =
+          rail_position.get_position() + action->train_stop_pos_delta;
     }
   }
 
-  void step(const MultiplexedSensor& sensor, uint8_t* servo_pos_out,
-            int8_t* motor_vel_out) {
+  void step(const MultiplexedSensor& sensor, MotionProfile* servo_profile,
+            uint16_t* servo_pos_out, int8_t* motor_vel_out) {
     if (action == NULL) {
       return;
     }
 
-    for (int8_t i = 0; i < N_SERVOS; i++) {
-      const uint8_t targ_pos = action->servo_pos[i];
-      if (targ_pos != Action::SERVO_POS_KEEP) {
-        servo_pos_out[i] =
-            interp(servo_pos_pre[i], targ_pos, (elapsed_step >> 5) + 1,
-                   (action->duration_step >> 5) + 1);
+    if (elapsed_step % PROFILE_STEP_MS == 0) {
+      for (int8_t i = 0; i < N_SERVOS; i++) {
+        if (action->servo_pos[i] != Action::SERVO_POS_KEEP) {
+          servo_profile[i].step();
+          servo_pos_out[i] = servo_profile[i].get_pos();
+        }
       }
     }
     for (int8_t i = 0; i < N_MOTORS; i++) {
@@ -82,155 +222,778 @@ class ActionExecState {
         motor_vel_out[i] = targ_vel;
       }
     }
-    if (sensor.get_sensor_t() > action->train_cutoff_thresh) {
-      motor_vel_out[MV_TRAIN] = 0;
+    if (action->spline_num_frames > 0) {
+      // Value at the end of this step, so that the last keyframe is reached.
+      const int16_t v = spline.eval(elapsed_step + 1);
+      const uint8_t t = action->spline_target;
+      if (t < N_SERVOS) {
+        servo_pos_out[t] = v;
+      } else {
+        motor_vel_out[t - N_SERVOS] = v;
+      }
+    }
+    if (action->has_train_stop()) {
+      // Armed at the beginning of the action (see arm_train_stop).
+      train_stop_triggered =
+          sensor.edge_t.is_tripped() || sensor.edge_o.is_tripped();
+      if (action->train_stop_pos_delta != Action::TRAIN_STOP_POS_NONE) {
+        // Wrap-around safe comparison.
+        const int16_t remaining =
+            train_stop_pos - rail_position.get_position();
+        if ((action->train_stop_pos_delta >= 0) ? (remaining <= 0)
+                                                : (remaining >= 0)) {
+          train_stop_triggered = true;
+        }
+      }
+      if (train_stop_triggered) {
+        motor_vel_out[MV_TRAIN] = 0;
+      }
     }
     elapsed_step++;
   }
 
+  // Action of duration N runs exactly N steps (but at least 1 step), so that
+  // the next action starts right in the next tick.
   bool is_running() const {
-    return action != NULL && (elapsed_step <= action->duration_step);
+    return action != NULL &&
+           (elapsed_step < action->duration_step || elapsed_step == 0);
+  }
+
+  // Number of profile steps taken by the action.
+  static uint16_t num_profile_steps(const Action& action) {
+    const uint16_t steps = (action.duration_step > 0) ? action.duration_step : 1;
+    return (steps + PROFILE_STEP_MS - 1) / PROFILE_STEP_MS;
+  }
+
+  uint16_t get_seq() const {
+    return (action != NULL) ? action->seq : Action::SEQ_NONE;
+  }
+
+  // Action is finished, but not yet removed from the queue.
+  bool is_done() const { return action != NULL && !is_running(); }
+
+  bool is_train_stop_triggered() const { return train_stop_triggered; }
+
+  void release_keyframes(KeyframePool& keyframes) const {
+    if (spline.get_num_frames() > 0) {
+      keyframes.release(spline.get_begin(), spline.get_num_frames());
+    }
   }
 
   void fill_status(ExecStatus& status) const {
-    status.duration_ms = action->duration_step;
     if (is_running()) {
       status.status = ExecStatus_Status_RUNNING;
+      status.duration_ms = action->duration_step;
       status.elapsed_ms = elapsed_step;
     } else if (action != NULL) {
       status.status = ExecStatus_Status_DONE;
+      status.duration_ms = action->duration_step;
       status.elapsed_ms = status.duration_ms;
     } else {
       status.status = ExecStatus_Status_IDLE;
+      status.duration_ms = 0;
       status.elapsed_ms = 0;
     }
   }
 };
 
+// Enqueued from main loop, and executed & popped from the tick.
+// The head action stays in the queue while it's executed (until pop), so that
+// enqueue never overwrites it.
+// Action slots shared by all lanes, so that a long sequence in one lane
+// (typically locomotion) can use slots that other lanes don't.
+//
+// Not atomic by itself: alloc / release must be called with interrupts
+// disabled, or from the tick.
+class ActionPool {
+ public:
+  static constexpr uint8_t SIZE = 16;
+
+ private:
+  Action slots[SIZE];
+  // Bit i is set when slots[i] is in use.
+  uint16_t used = 0;
+
+ public:
+  // Returns slot index, or -1 when full.
+  int8_t alloc() {
+    for (uint8_t i = 0; i < SIZE; i++) {
+      if ((used & (1U << i)) == 0) {
+        used |= 1U << i;
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void release(uint8_t ix) { used &= ~(1U << ix); }
+
+  uint8_t count_free() const {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < SIZE; i++) {
+      if ((used & (1U << i)) == 0) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  Action& at(uint8_t ix) { return slots[ix]; }
+  const Action& at(uint8_t ix) const { return slots[ix]; }
+};
+
+// FIFO of actions in one lane. Actions are stored in ActionPool, and the
+// queue only keeps slot indices.
 class ActionQueue {
  public:
+  // Max actions per lane (including the running one).
   const static uint8_t SIZE = 8;
 
  private:
-  Action queue[SIZE];
+  ActionPool* pool = nullptr;
+  uint8_t slots[SIZE];
   uint8_t ix = 0;
-  uint8_t n = 0;
+  volatile uint8_t n = 0;
 
  public:
-  void enqueue(const Action& astate) {
-    queue[(ix + n) % SIZE] = astate;
-    n += 1;
+  void set_pool(ActionPool* p) { pool = p; }
+
+  // Returns false when the lane or the pool is full.
+  bool enqueue(const Action& astate) {
+    // The tick can drop actions (truncate) in between.
+    const uint8_t sreg = SREG;
+    cli();
+    const bool ok = insert(n, astate);
+    SREG = sreg;
+    return ok;
   }
 
-  Action* peek() {
+  const Action* peek() const {
     if (n == 0) {
       return NULL;
     } else {
-      return &queue[ix];
+      return at(0);
     }
   }
 
-  Action* pop() {
-    if (n == 0) {
+  // Next action after the head (lookahead), if any.
+  const Action* peek_next() const {
+    if (n < 2) {
       return NULL;
     } else {
-      Action* ptr = &queue[ix];
+      return at(1);
+    }
+  }
+
+  // i-th action from the head. i < count().
+  const Action* at(uint8_t i) const {
+    return &pool->at(slots[(ix + i) % SIZE]);
+  }
+
+  // Edits below (except enqueue) must be done with interrupts disabled (w.r.t.
+  // the tick), or from the tick.
+
+  void pop() {
+    if (n > 0) {
+      pool->release(slots[ix]);
       ix = (ix + 1) % SIZE;
       n -= 1;
-      return ptr;
     }
   }
 
-  void clear() { n = 0; }
+  // Index of action with seq, or -1 if not found.
+  int8_t find(uint16_t seq) const {
+    for (uint8_t i = 0; i < n; i++) {
+      if (at(i)->seq == seq) {
+        return i;
+      }
+    }
+    return -1;
+  }
 
-  uint8_t count() const { return n; }
+  // Insert action before i-th action. Returns false when full.
+  bool insert(uint8_t i, const Action& action) {
+    if (n >= SIZE) {
+      return false;
+    }
+    const int8_t slot = pool->alloc();
+    if (slot < 0) {
+      return false;
+    }
+    pool->at(slot) = action;
+    for (uint8_t j = n; j > i; j--) {
+      slots[(ix + j) % SIZE] = slots[(ix + j - 1) % SIZE];
+    }
+    slots[(ix + i) % SIZE] = slot;
+    n += 1;
+    return true;
+  }
 
-  void fill_status(QueueStatus& status) const {
-    status.queued = n;
-    status.free = SIZE - n;
+  void replace(uint8_t i, const Action& action) {
+    pool->at(slots[(ix + i) % SIZE]) = action;
   }
+
+  // Keep only first new_count actions.
+  void truncate(uint8_t new_count) {
+    while (n > new_count) {
+      n -= 1;
+      pool->release(slots[(ix + n) % SIZE]);
+    }
+  }
+
+  uint8_t count() const { return n; }
 };
 
+// Payload of EMERGENCY_ACK packet. Layout is in worker/README.md.
+struct EmergencyAck {
+  uint8_t op;
+  uint16_t preempted_seq;
+  // Reception to motor commit, saturates at 0xffff.
+  uint16_t latency_us;
+} __attribute__((packed));
+
 // Must be instantiated at most only after reset.
 class ActionExecutorSingleton {
  public:
-  ActionQueue queue;
-  ActionExecState state;
+  struct Lane {
+    ActionQueue queue;
+    ActionExecState state;
+  };
+  Lane lanes[N_LANES];
+  ActionPool actions;
+  KeyframePool keyframes;
 
-  // Position based control. Set position will be maintained automatically
-  // (using Timer1) in Calibrated Servo.
-  uint8_t servo_pos[N_SERVOS];
+  // Servo motion profiles, restarted by whichever lane moves the servo.
+  MotionProfile servo_profile[N_SERVOS];
+  // Direction (+1 / -1) of servo that didn't ease out, because the next
+  // action was continuing the move. 0 otherwise.
+  int8_t servo_cruise_dir[N_SERVOS] = {};
+
+  // Position based control (pulse width in us). Set position will be
+  // maintained automatically by ServoPWM.
+  uint16_t servo_pos[N_SERVOS];
 
   // Velocity based control for DC motors. This class is responsible for PWM-ing
   // them, even when no action is being executed. -0x7f~0x7f (7 bit effective)
   DCMotor motors[N_MOTORS];
+  // Target velocity. Actual output follows it within motor_ramps limits.
   int8_t motor_vel[N_MOTORS];
-  int8_t motor_vel_prev[N_MOTORS];
+  MotorRamp motor_ramps[N_MOTORS];
 
   uint8_t gv = 0;
 
-  static const uint8_t TCCR1A_FAST_PWM_8 = _BV(WGM10);
-  static const uint8_t TCCR1B_FAST_PWM_8 = _BV(WGM12);
-  static const uint8_t TCCR1A_A_NON_INVERT = _BV(COM1A1);
-  static const uint8_t TCCR1A_B_NON_INVERT = _BV(COM1B1);
-  static const uint8_t TCCR1B_PRESCALER_1024 = _BV(CS12) | _BV(CS10);
+  static constexpr uint16_t DEFAULT_JOG_DEADMAN_MS = 200;
 
-  static const uint8_t TCCR2A_FAST_PWM = _BV(WGM21) | _BV(WGM20);
-  static const uint8_t TCCR2A_A_NON_INVERT = _BV(COM2A1);
-  static const uint8_t TCCR2A_B_NON_INVERT = _BV(COM2B1);
-  static const uint8_t TCCR2B_PRESCALER_1024 =
-      _BV(CS22) | _BV(CS21) | _BV(CS20);
+ private:
+  uint16_t last_seq = Action::SEQ_NONE;
 
-  static const uint8_t T_SEN_CACHE_SIZE = 100;
-  uint8_t tr_sensor_cache[T_SEN_CACHE_SIZE];
-  uint8_t tr_sensor_cache_ix;
+  // HOLD: lanes are paused (with motors stopped) until RESUME.
+  bool held = false;
+  // Set by STOP, until taken by take_stop().
+  bool stopped = false;
+
+  // Jog (teleop) setpoints, applied over actions until jog_ttl_ms expires.
+  // Action::*_KEEP means not jogged.
+  int8_t jog_vel[N_MOTORS];
+  uint16_t jog_pos[N_SERVOS];
+  uint16_t jog_ttl_ms = 0;
+  uint16_t jog_deadman_ms = DEFAULT_JOG_DEADMAN_MS;
+
+  // Plan being executed. Shadow plan is active_plan + 1.
+  uint8_t active_plan = 0;
+  // Swap plans when this action finishes.
+  uint16_t swap_after_seq = Action::SEQ_NONE;
+  uint16_t max_emergency_latency_us = 0;
+  // Set by the tick when an emergency op is applied, until taken by main loop.
+  // Only the latest one is kept.
+  EmergencyAck emergency_ack;
+  bool emergency_ack_pending = false;
 
  public:
   ActionExecutorSingleton()
-      : servo_pos{50, 5},
+      : servo_pos{ServoPWM::legacy_pos_to_us(50),
+                  ServoPWM::legacy_pos_to_us(5)},
         motors{// train
                DCMotor(0x60),
                // ori
                DCMotor(0x61),
                // screw
-               DCMotor(0x62)} {}
+               DCMotor(0x62)} {
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      lanes[i].queue.set_pool(&actions);
+    }
+  }
 
   void init() {
-    // Init servo PWM (freq_pwm=61.0Hz, dur=16.4 ms)
-    TCCR2A = TCCR2A_FAST_PWM | TCCR2A_A_NON_INVERT | TCCR2A_B_NON_INVERT;
-    TCCR2B = TCCR2B_PRESCALER_1024;
-
-    // Set PWM ports as output.
-    DDRB |= _BV(3);  // PWMA
-    DDRD |= _BV(3);  // PWMB
+    load_motor_limits();
+    servos.init(servo_pos);
     commit_posvel();
   }
 
   void loop1ms() {
     sensor.loop1ms();
+    if (!held) {
+      step_lanes();
+      apply_jog();
+    }
 
-    if (state.is_running()) {
-      state.step(sensor, servo_pos, motor_vel);
-      if (sensor.is_start()) {
-        if (tr_sensor_cache_ix < T_SEN_CACHE_SIZE) {
-          tr_sensor_cache[tr_sensor_cache_ix] = sensor.get_sensor_t();
-          tr_sensor_cache_ix++;
+    // Checked right before committing, so that emergency commands received
+    // while stepping still take effect in this tick.
+    uint32_t received_ticks;
+    const uint8_t emergency_op = take_emergency_op(received_ticks);
+    const uint16_t preempted_seq = get_running_seq();
+    const bool emergency_ok =
+        emergency_op != 0 && apply_emergency(emergency_op);
+
+    // Motors keep ramping even after the action ended.
+    commit_posvel();
+
+    if (emergency_ok) {
+      const uint8_t sreg = SREG;
+      cli();
+      const uint32_t now = timer0_ticks();
+      SREG = sreg;
+      const uint32_t latency_us = timer0_ticks_to_us(now - received_ticks);
+      const uint16_t latency =
+          (latency_us > UINT16_MAX) ? UINT16_MAX : latency_us;
+      if (latency > max_emergency_latency_us) {
+        max_emergency_latency_us = latency;
+      }
+      emergency_ack.op = emergency_op;
+      emergency_ack.preempted_seq = preempted_seq;
+      emergency_ack.latency_us = latency;
+      emergency_ack_pending = true;
+      TWELITE_INFO(emergency_op, preempted_seq, latency, max_emergency_latency_us);  // emergency {=u8} preempted seq {=u16}: {=u16}us (max {=u16}us)
+    }
+  }
+
+  bool is_held() const { return held; }
+
+  // Returns true (and fills ack) once after an emergency op is applied.
+  // Called from main loop.
+  bool take_emergency_ack(EmergencyAck& ack) {
+    const uint8_t sreg = SREG;
+    cli();
+    const bool pending = emergency_ack_pending;
+    ack = emergency_ack;
+    emergency_ack_pending = false;
+    SREG = sreg;
+    return pending;
+  }
+
+  // Stream servo / motor setpoints (servo_pos, motor_vel of setpoint),
+  // bypassing the queues. They're applied from the next tick, over actions.
+  // Jogged motors stop when no new setpoint arrives within the deadman
+  // window.
+  // Ignored (with error) while held, so that it doesn't take effect after
+  // RESUME.
+  void jog(const Action& setpoint) {
+    const uint8_t sreg = SREG;
+    cli();
+    if (held) {
+      SREG = sreg;
+      TWELITE_ERROR(Cause_OVERMIND);  // jog ignored while held
+      return;
+    }
+    for (uint8_t i = 0; i < N_MOTORS; i++) {
+      jog_vel[i] = setpoint.motor_vel[i];
+    }
+    for (uint8_t i = 0; i < N_SERVOS; i++) {
+      jog_pos[i] = setpoint.servo_pos[i];
+    }
+    jog_ttl_ms = jog_deadman_ms;
+    SREG = sreg;
+  }
+
+  void set_jog_deadman(uint16_t ms) {
+    const uint8_t sreg = SREG;
+    cli();
+    jog_deadman_ms = ms;
+    SREG = sreg;
+  }
+
+  // Returns true once after STOP, so that the caller can also stop things
+  // that enqueue actions (e.g. ActionVM).
+  bool take_stop() {
+    const bool s = stopped;
+    stopped = false;
+    return s;
+  }
+
+ private:
+  void step_lanes() {
+    // Retire finished actions first, so that sync actions behind them count
+    // as waiting in this tick.
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      Lane& lane = lanes[i];
+      if (lane.state.is_done()) {
+        if (lane.state.get_seq() == swap_after_seq) {
+          swap_plan();
+        }
+        lane.state.release_keyframes(keyframes);
+        lane.state = ActionExecState();
+        lane.queue.pop();
+      }
+    }
+    // Drop remaining actions of old plans (after swap).
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      Lane& lane = lanes[i];
+      while (!lane.state.is_running() && lane.queue.count() > 0 &&
+             plan_age(*lane.queue.peek()) > 0) {
+        release_keyframes(*lane.queue.peek());
+        lane.queue.pop();
+      }
+    }
+
+    const uint8_t sync_waiting = get_sync_waiting_lanes();
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      Lane& lane = lanes[i];
+      if (!lane.state.is_running()) {
+        // Fetch new action, and step it in the same tick.
+        const Action* new_action = lane.queue.peek();
+        if (new_action == NULL || plan_age(*new_action) < 0 ||
+            (new_action->sync_mask & ~sync_waiting) != 0) {
+          continue;
+        }
+        lane.state =
+            ActionExecState(new_action, servo_pos, motor_vel, keyframes);
+        begin_servo_profiles(*new_action, lane.queue.peek_next());
+        if (i == LANE_LOCO) {
+          arm_train_stop(*new_action);
         }
       }
-      commit_posvel();
+      lane.state.step(sensor, servo_profile, servo_pos, motor_vel);
+      if (lane.state.is_train_stop_triggered()) {
+        motor_ramps[MV_TRAIN].stop_now();
+      }
+    }
+  }
+
+  void apply_jog() {
+    if (jog_ttl_ms == 0) {
+      return;
+    }
+    jog_ttl_ms--;
+    const bool expired = jog_ttl_ms == 0;
+    for (uint8_t i = 0; i < N_MOTORS; i++) {
+      if (jog_vel[i] != Action::MOTOR_VEL_KEEP) {
+        motor_vel[i] = expired ? 0 : jog_vel[i];
+      }
+    }
+    if (expired) {
+      TWELITE_INFO();  // jog deadman expired, motors stopped
+      return;
+    }
+    for (uint8_t i = 0; i < N_SERVOS; i++) {
+      if (jog_pos[i] != Action::SERVO_POS_KEEP) {
+        servo_pos[i] = jog_pos[i];
+      }
+    }
+  }
+
+  static uint8_t take_emergency_op(uint32_t& received_ticks) {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint8_t op = g_emergency_op;
+    g_emergency_op = 0;
+    received_ticks = g_emergency_ticks;
+    SREG = sreg;
+    return op;
+  }
+
+  // Motors stop immediately (bypassing ramps) and servos stay where they
+  // are, for STOP & HOLD.
+  bool apply_emergency(uint8_t op) {
+    switch (op) {
+      case EMERGENCY_STOP:
+        clear_lanes(false);
+        jog_ttl_ms = 0;
+        stopped = true;
+        held = false;
+        stop_actuators();
+        break;
+      case EMERGENCY_CLEAR:
+        clear_lanes(true);
+        break;
+      case EMERGENCY_HOLD:
+        held = true;
+        jog_ttl_ms = 0;
+        stop_actuators();
+        break;
+      case EMERGENCY_RESUME:
+        held = false;
+        break;
+      default:
+        TWELITE_ERROR(Cause_OVERMIND, op);  // unknown emergency op: {=u8}
+        return false;
+    }
+    return true;
+  }
+
+  void stop_actuators() {
+    for (uint8_t i = 0; i < N_MOTORS; i++) {
+      motor_vel[i] = 0;
+      motor_ramps[i].stop_now();
+    }
+    for (uint8_t i = 0; i < N_SERVOS; i++) {
+      servo_cruise_dir[i] = 0;
+    }
+  }
+
+  // Remove queued actions (and running ones unless keep_running) of all
+  // lanes. Pending swap_plan_after() is cancelled unless its action is kept.
+  void clear_lanes(bool keep_running) {
+    bool keep_swap = false;
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      Lane& lane = lanes[i];
+      const bool keep_head = keep_running && lane.state.is_running();
+      if (keep_head && lane.state.get_seq() == swap_after_seq) {
+        keep_swap = true;
+      }
+      if (!keep_head) {
+        lane.state.release_keyframes(keyframes);
+        lane.state = ActionExecState();
+      }
+      const uint8_t num_keep = keep_head ? 1 : 0;
+      for (uint8_t j = num_keep; j < lane.queue.count(); j++) {
+        release_keyframes(*lane.queue.at(j));
+      }
+      lane.queue.truncate(num_keep);
+    }
+    if (!keep_swap) {
+      swap_after_seq = Action::SEQ_NONE;
+    }
+  }
+
+  void release_keyframes(const Action& action) {
+    if (action.spline_num_frames > 0) {
+      keyframes.release(action.spline_begin, action.spline_num_frames);
+    }
+  }
+
+ public:
+
+  // persist: Also store to EEPROM (takes a few ms), so that limits survive
+  // reset.
+  void set_motor_limits(uint8_t ix, const MotorRamp::Limits& limits,
+                        bool persist) {
+    motor_ramps[ix].set_limits(limits);
+    if (persist) {
+      MotorLimitsRecord record;
+      record.version = MotorLimitsRecord::VERSION;
+      for (uint8_t i = 0; i < N_MOTORS; i++) {
+        record.limits[i] = motor_ramps[i].get_limits();
+      }
+      eeprom_update_block(&record, eeprom_motor_limits(), sizeof(record));
+    }
+  }
+
+  // Called from main loop (or ActionVM). Returns false (with error) when the
+  // action is rejected. Accepted action is assigned get_last_seq().
+  //
+  // shadow: Add to the shadow plan, which starts after swap_plan().
+  bool enqueue(const Action& action, bool shadow = false) {
+    ActionQueue& queue = lanes[action.lane].queue;
+    Action numbered = action;
+    numbered.seq = next_seq();
+
+    // Plan must not be swapped in between.
+    const uint8_t sreg = SREG;
+    cli();
+    numbered.plan = active_plan + (shadow ? 1 : 0);
+    bool ok = is_lane_ok(action, action.lane);
+    if (ok && !shadow && queue.count() > 0 &&
+        plan_age(*queue.at(queue.count() - 1)) < 0) {
+      // Queue is FIFO, so active actions can't follow shadow ones.
+      TWELITE_ERROR(Cause_OVERMIND, action.lane);  // lane has shadow plan: {=u8}
+      ok = false;
+    }
+    if (ok && !queue.enqueue(numbered)) {
+      TWELITE_ERROR(Cause_OVERMIND, action.lane);  // lane queue full: {=u8}
+      ok = false;
+    }
+    SREG = sreg;
+
+    if (ok) {
+      last_seq = numbered.seq;
     } else {
-      // Fetch new action.
-      Action* new_action = queue.pop();
-      state = ActionExecState(new_action, servo_pos);
-      if (new_action != NULL) {
-        tr_sensor_cache_ix = 0;
+      release_keyframes(action);
+    }
+    return ok;
+  }
+
+  uint16_t get_last_seq() const { return last_seq; }
+
+  // Seq of the action running in the first busy lane, or SEQ_NONE.
+  uint16_t get_running_seq() const {
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      if (lanes[i].state.is_running()) {
+        return lanes[i].state.get_seq();
+      }
+    }
+    return Action::SEQ_NONE;
+  }
+
+  // Make shadow plan active. Running actions finish normally, and then each
+  // lane continues with the (previously) shadow plan.
+  void swap_plan() {
+    const uint8_t sreg = SREG;
+    cli();
+    active_plan++;
+    swap_after_seq = Action::SEQ_NONE;
+    SREG = sreg;
+  }
+
+  // swap_plan() when action seq finishes (e.g. at a sync point). Returns
+  // false (with error) unless seq is queued in the active plan.
+  bool swap_plan_after(uint16_t seq) {
+    const uint8_t sreg = SREG;
+    cli();
+    uint8_t lane_ix;
+    const int8_t i = find_queued(seq, lane_ix);
+    const bool ok = i >= 0 && plan_age(*lanes[lane_ix].queue.at(i)) == 0;
+    if (ok) {
+      swap_after_seq = seq;
+    } else if (i >= 0) {
+      TWELITE_ERROR(Cause_OVERMIND, seq);  // swap point not in active plan: {=u16}
+    }
+    SREG = sreg;
+    return ok;
+  }
+
+  void discard_shadow_plan() {
+    const uint8_t sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      ActionQueue& queue = lanes[i].queue;
+      uint8_t n = queue.count();
+      while (n > 0 && plan_age(*queue.at(n - 1)) < 0) {
+        n--;
+        release_keyframes(*queue.at(n));
       }
+      queue.truncate(n);
     }
+    swap_after_seq = Action::SEQ_NONE;
+    SREG = sreg;
   }
 
-  void enqueue(Action& astate) { queue.enqueue(astate); }
+  // In-flight queue edits, addressed by seq. Called from main loop, and
+  // atomic w.r.t. the tick. Return false (with error) when rejected.
+  //
+  // Only pending (not yet started) actions can be replaced or inserted
+  // before. New action is put in the lane of the target action.
 
-  bool is_idle() const { return queue.count() == 0 && !state.is_running(); }
+  // Remove all actions after seq in its lane.
+  bool truncate_after(uint16_t seq) {
+    const uint8_t sreg = SREG;
+    cli();
+    uint8_t lane_ix;
+    const int8_t i = find_queued(seq, lane_ix);
+    if (i >= 0) {
+      ActionQueue& queue = lanes[lane_ix].queue;
+      for (uint8_t j = i + 1; j < queue.count(); j++) {
+        release_keyframes(*queue.at(j));
+      }
+      queue.truncate(i + 1);
+    }
+    SREG = sreg;
+    return i >= 0;
+  }
+
+  // Replaced action keeps seq.
+  bool replace(uint16_t seq, const Action& action) {
+    const uint8_t sreg = SREG;
+    cli();
+    uint8_t lane_ix;
+    const int8_t i = find_pending(seq, lane_ix);
+    const bool ok = i >= 0 && is_lane_ok(action, lane_ix);
+    if (ok) {
+      ActionQueue& queue = lanes[lane_ix].queue;
+      release_keyframes(*queue.at(i));
+      Action replacement = action;
+      replacement.lane = lane_ix;
+      replacement.seq = seq;
+      replacement.plan = queue.at(i)->plan;
+      queue.replace(i, replacement);
+    }
+    SREG = sreg;
+    if (!ok) {
+      release_keyframes(action);
+    }
+    return ok;
+  }
+
+  // Inserted action is assigned get_last_seq().
+  bool insert_before(uint16_t seq, const Action& action) {
+    const uint8_t sreg = SREG;
+    cli();
+    uint8_t lane_ix;
+    const int8_t i = find_pending(seq, lane_ix);
+    bool ok = i >= 0 && is_lane_ok(action, lane_ix);
+    if (ok) {
+      Action inserted = action;
+      inserted.lane = lane_ix;
+      inserted.seq = next_seq();
+      inserted.plan = lanes[lane_ix].queue.at(i)->plan;
+      ok = lanes[lane_ix].queue.insert(i, inserted);
+      if (ok) {
+        last_seq = inserted.seq;
+      } else {
+        TWELITE_ERROR(Cause_OVERMIND, lane_ix);  // lane queue full for insert: {=u8}
+      }
+    }
+    SREG = sreg;
+    if (!ok) {
+      release_keyframes(action);
+    }
+    return ok;
+  }
+
+  // True when num_actions[lane] more actions fit in each lane.
+  bool has_room(const uint8_t* num_actions) const {
+    uint8_t total = 0;
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      if (lanes[i].queue.count() + num_actions[i] > ActionQueue::SIZE) {
+        return false;
+      }
+      total += num_actions[i];
+    }
+    return total <= actions.count_free();
+  }
+
+  bool is_full(uint8_t lane) const {
+    return lanes[lane].queue.count() >= ActionQueue::SIZE ||
+           actions.count_free() == 0;
+  }
+
+  // Train stop conditions are evaluated by ADC ISR as soon as new sample
+  // arrives, and applied at the next tick.
+  //
+  // Stopping motor directly from ADC ISR is not possible, because the tick
+  // might be in the middle of I2C transaction with motor drivers.
+  static void arm_train_stop(const Action& action) {
+    if (action.train_cutoff_thresh == 255) {
+      sensor.edge_t.arm_trip(EdgeDetector::NO_TRIP);
+    } else {
+      // sensor > thresh (8 bit) <=> sensor >= thresh + 1 (8 bit)
+      sensor.edge_t.set_threshold((action.train_cutoff_thresh + 1) << 4);
+      sensor.edge_t.arm_trip(0);
+    }
+    if (action.train_stop_markers == 255) {
+      sensor.edge_o.arm_trip(EdgeDetector::NO_TRIP);
+    } else {
+      sensor.edge_o.arm_trip(action.train_stop_markers);
+    }
+  }
+
+  bool is_idle() const {
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      if (lanes[i].queue.count() > 0) {
+        return false;
+      }
+    }
+    return true;
+  }
 
   void fill_i2c_scan_result(I2CScanResult& result) const {
     result.type = I2CScanResult_ResultType_OK;
@@ -255,21 +1018,56 @@ class ActionExecutorSingleton {
     result.device_count = dev_ix;
   }
 
-  void fill_status(Status& status) const {
-    status.worker_type = WorkerType_BUILDER;
-    fill_status_system(status.system);
+  void fill_status_system(SystemStatus& status) const {
+    status.vcc_mv = sensor.get_vcc_mv();
+    status.bat_mv = sensor.get_bat_mv();
+    status.recv_byte = twelite.get_data_bytes_recv();
+    status.sent_byte = twelite.get_data_bytes_sent();
+    status.num_valid_packet = twelite.get_num_valid_packet();
+    status.num_invalid_packet = twelite.get_num_invalid_packet();
+    status.num_dropped_frame = twelite.get_num_dropped_frame();
+    status.recv_queue_high_water = twelite.get_recv_queue_high_water();
+    status.num_tx_dropped = tx_scheduler.get_num_dropped();
+    status.num_tx_ok = tx_scheduler.get_num_ok();
+    status.num_tx_fail = tx_scheduler.get_num_fail();
+    status.num_tx_timeout = tx_scheduler.get_num_timeout();
+    status.stack_free = get_stack_free();
+    status.num_skipped_tick = g_num_skipped_ticks;
+  }
 
-    state.fill_status(status.exec);
-    queue.fill_status(status.queue);
+  void fill_status_exec(ExecStatus& status) const {
+    lanes[get_exec_lane()].state.fill_status(status);
+  }
+
+  void fill_status_queue(QueueStatus& status) const {
+    status.free = get_queue_free();
+    status.queued = ActionPool::SIZE - status.free;
+  }
+
+  void fill_beacon(BeaconDigest& digest) const {
+    ExecStatus exec;
+    lanes[get_exec_lane()].state.fill_status(exec);
+    digest.flags = exec.status;
+    if (held) {
+      digest.flags |= BeaconDigest::FLAG_HELD;
+    }
+    if (jog_ttl_ms > 0) {
+      digest.flags |= BeaconDigest::FLAG_JOGGING;
+    }
+    digest.running_seq = get_running_seq();
+    digest.last_seq = last_seq;
+    digest.queue_free = get_queue_free();
+    const uint16_t bat_mv_32 = sensor.get_bat_mv() / 32;
+    digest.bat_mv_32 = (bat_mv_32 > 0xff) ? 0xff : bat_mv_32;
   }
 
   void fill_output_status(OutputStatus& status) const {
     // TODO: Proper index mapping
-    status.loc_forward_vel = motor_vel[0];
-    status.loc_rotation_vel = motor_vel[1];
+    status.loc_forward_vel = motor_ramps[0].get_output();
+    status.loc_rotation_vel = motor_ramps[1].get_output();
 
     // Right block.
-    status.driver_lock_vel = motor_vel[2];
+    status.driver_lock_vel = motor_ramps[2].get_output();
     status.driver_z_pos = servo_pos[0];
     status.driver_y_pos = servo_pos[1];
 
@@ -278,27 +1076,134 @@ class ActionExecutorSingleton {
   }
 
  private:
-  void fill_status_system(SystemStatus& status) const {
-    status.vcc_mv = sensor.get_vcc_mv();
-    status.bat_mv = sensor.get_bat_mv();
-    status.recv_byte = twelite.get_data_bytes_recv();
-    status.sent_byte = twelite.get_data_bytes_sent();
-    status.num_valid_packet = twelite.get_num_valid_packet();
-    status.num_invalid_packet = twelite.get_num_invalid_packet();
+  // Servos that continue in the same direction in the next action (lookahead)
+  // don't ease out, and then the next action doesn't ease in. Thus a chain of
+  // short moves doesn't stop at each boundary.
+  void begin_servo_profiles(const Action& action, const Action* next) {
+    const uint16_t num_steps = ActionExecState::num_profile_steps(action);
+    for (uint8_t i = 0; i < N_SERVOS; i++) {
+      const uint16_t target = action.servo_pos[i];
+      if (target == Action::SERVO_POS_KEEP) {
+        continue;
+      }
+      const int8_t dir = (target > servo_pos[i]) ? 1 : -1;
+      // The next action might have been replaced after the previous one
+      // decided not to ease out.
+      const bool cruise_in = servo_cruise_dir[i] == dir;
+      const bool cruise_out =
+          next != NULL && is_monotone(servo_pos[i], target, next->servo_pos[i]);
+      servo_profile[i].begin(servo_pos[i], target, num_steps,
+                             action.servo_shape, !cruise_in, !cruise_out);
+      servo_cruise_dir[i] = cruise_out ? dir : 0;
+    }
+  }
+
+  static bool is_monotone(uint16_t from, uint16_t via, uint16_t to) {
+    if (to == Action::SERVO_POS_KEEP) {
+      return false;
+    }
+    return (from < via && via < to) || (from > via && via > to);
+  }
+
+  // > 0: old plan, 0: active plan, < 0: shadow plan.
+  int8_t plan_age(const Action& action) const {
+    return static_cast<int8_t>(active_plan - action.plan);
+  }
+
+  uint16_t next_seq() const {
+    return (last_seq + 1 == Action::SEQ_NONE) ? last_seq + 2 : last_seq + 1;
+  }
+
+  static bool is_lane_ok(const Action& action, uint8_t lane_ix) {
+    if (lane_ix != LANE_LOCO && action.has_train_stop()) {
+      // Train stop sensors can be armed for only one action at a time.
+      TWELITE_ERROR(Cause_OVERMIND, lane_ix);  // train stop outside lane 0: {=u8}
+      return false;
+    }
+    return true;
+  }
+
+  // Returns index in lane_ix queue, or -1 (with error).
+  int8_t find_queued(uint16_t seq, uint8_t& lane_ix) const {
+    for (lane_ix = 0; lane_ix < N_LANES; lane_ix++) {
+      const int8_t i = lanes[lane_ix].queue.find(seq);
+      if (i >= 0) {
+        return i;
+      }
+    }
+    TWELITE_ERROR(Cause_OVERMIND, seq);  // seq not in queue: {=u16}
+    return -1;
+  }
+
+  // Same as find_queued, but also rejects started action.
+  int8_t find_pending(uint16_t seq, uint8_t& lane_ix) const {
+    const int8_t i = find_queued(seq, lane_ix);
+    if (i == 0 && lanes[lane_ix].state.get_seq() == seq) {
+      TWELITE_ERROR(Cause_OVERMIND, seq);  // seq already started: {=u16}
+      return -1;
+    }
+    return i;
+  }
+
+  // First busy lane (or lane 0), which represents exec status.
+  uint8_t get_exec_lane() const {
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      if (lanes[i].queue.count() > 0) {
+        return i;
+      }
+    }
+    return 0;
+  }
+
+  uint8_t get_queue_free() const { return actions.count_free(); }
+
+  // Lanes whose next action is a sync action.
+  uint8_t get_sync_waiting_lanes() const {
+    uint8_t mask = 0;
+    for (uint8_t i = 0; i < N_LANES; i++) {
+      const Action* next = lanes[i].queue.peek();
+      if (!lanes[i].state.is_running() && next != NULL &&
+          plan_age(*next) == 0 && next->sync_mask != 0) {
+        mask |= 1 << i;
+      }
+    }
+    return mask;
   }
 
   void commit_posvel() {
-    // Set PWM
-    OCR2A = servo_pos[CIX_A];
-    OCR2B = servo_pos[CIX_B];
+    servos.set_pulse_us(0, servo_pos[CIX_A]);
+    servos.set_pulse_us(1, servo_pos[CIX_B]);
 
     // I2C takes time, need to conserve time. Otherwise MCU become
-    // unresponsive.
+    // unresponsive. (DCMotor only writes when VSET changes)
     for (int i = 0; i < N_MOTORS; i++) {
-      if (motor_vel[i] != motor_vel_prev[i]) {
-        motors[i].set_velocity(motor_vel[i]);
-        motor_vel_prev[i] = motor_vel[i];
-      }
+      motors[i].set_velocity(motor_ramps[i].step(motor_vel[i]));
+    }
+  }
+
+  struct MotorLimitsRecord {
+    // Erased EEPROM (0xff) or old layout is ignored.
+    static constexpr uint8_t VERSION = 1;
+
+    uint8_t version;
+    MotorRamp::Limits limits[N_MOTORS];
+  };
+
+  static_assert(sizeof(MotorLimitsRecord) <= EEPROM_MOTOR_LIMITS_SIZE,
+                "MotorLimitsRecord doesn't fit in EEPROM layout");
+
+  static MotorLimitsRecord* eeprom_motor_limits() {
+    return reinterpret_cast<MotorLimitsRecord*>(EEPROM_MOTOR_LIMITS_ADDR);
+  }
+
+  void load_motor_limits() {
+    MotorLimitsRecord record;
+    eeprom_read_block(&record, eeprom_motor_limits(), sizeof(record));
+    if (record.version != MotorLimitsRecord::VERSION) {
+      return;  // use defaults
+    }
+    for (uint8_t i = 0; i < N_MOTORS; i++) {
+      motor_ramps[i].set_limits(record.limits[i]);
     }
   }
 };
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "action.hpp"
+#include "shared_state.h"
+
+// Tiny bytecode interpreter for action programs, executed from the 1ms tick.
+// Programs can branch on sensors and loop, so that workers can run build
+// sub-steps (e.g. "retry grab until sensor triggers") without a round trip
+// to the host for each decision.
+//
+// Program format is in worker/README.md ("Action Program"). Multi-byte
+// operands are little endian. At most MAX_INSNS_PER_TICK instructions are
+// executed per tick, and WAIT_* instructions yield to the next tick until
+// their condition is met.
+class ActionVM {
+ public:
+  static constexpr uint8_t MAX_PROGRAM_SIZE = 64;
+  static constexpr uint8_t NUM_REGS = 4;
+  static_assert((NUM_REGS & (NUM_REGS - 1)) == 0,
+                "NUM_REGS must be a power of 2 (register operands are masked)");
+  static constexpr uint8_t MAX_INSNS_PER_TICK = 16;
+
+  enum Op : uint8_t {
+    OP_END = 0,        // ()
+    OP_ACT = 1,        // dur:u16 n:u8 (target:u8 value:i16)*n
+    OP_WAIT_IDLE = 2,  // ()
+    OP_WAIT_MS = 3,    // ms:u16
+    OP_WAIT_GE = 4,    // src:u8 value:i16 timeout_ms:u16
+    OP_WAIT_LT = 5,    // src:u8 value:i16 timeout_ms:u16
+    OP_LD = 6,         // r:u8 src:u8
+    OP_LDI = 7,        // r:u8 imm:i16
+    OP_ADDI = 8,       // r:u8 imm:i16
+    OP_CMP_GE = 9,     // r:u8 imm:i16
+    OP_JMP = 10,       // addr:u8
+    OP_JT = 11,        // addr:u8
+    OP_JF = 12,        // addr:u8
+    OP_DJNZ = 13,      // r:u8 addr:u8
+    OP_EMIT = 14,      // code:u8
+  };
+
+  enum Source : uint8_t {
+    SRC_S0 = 0,
+    SRC_S1 = 1,
+    SRC_S2 = 2,
+    SRC_RAIL_MARKERS = 3,
+    SRC_RAIL_POS = 4,
+    SRC_ODOMETRY = 5,
+    SRC_BAT_MV = 6,
+  };
+
+  // ACT target with this bit set takes value from register (value & 3).
+  static constexpr uint8_t TARGET_FROM_REG = 0x80;
+
+ private:
+  uint8_t program[MAX_PROGRAM_SIZE];
+  uint8_t size = 0;
+
+  // Set by main loop (load), cleared by either.
+  volatile bool running = false;
+  uint8_t pc = 0;
+  int16_t regs[NUM_REGS];
+  bool flag = false;
+
+  // Remaining time of current WAIT_*. Valid only when waiting.
+  uint16_t wait_ms = 0;
+  bool waiting = false;
+
+ public:
+  // Stop current program and start new one. Empty program just stops.
+  // Called from main loop. The tick always completes before main loop
+  // resumes, so stopping first makes the copy safe.
+  bool load(const uint8_t* code, uint8_t code_size) {
+    running = false;
+    if (code_size > MAX_PROGRAM_SIZE) {
+      return false;
+    }
+    memcpy(program, code, code_size);
+    size = code_size;
+    pc = 0;
+    for (uint8_t i = 0; i < NUM_REGS; i++) {
+      regs[i] = 0;
+    }
+    flag = false;
+    waiting = false;
+    running = code_size > 0;
+    return true;
+  }
+
+  void stop() { running = false; }
+
+  bool is_running() const { return running; }
+
+  void loop1ms(ActionExecutorSingleton& exec) {
+    for (uint8_t i = 0; i < MAX_INSNS_PER_TICK && running; i++) {
+      if (!step(exec)) {
+        break;
+      }
+    }
+  }
+
+ private:
+  // Execute one instruction. Returns false to yield until the next tick.
+  bool step(ActionExecutorSingleton& exec) {
+    if (!has_operands(0)) {
+      return false;
+    }
+    const uint8_t op = program[pc];
+    switch (op) {
+      case OP_END:
+        running = false;
+        return false;
+      case OP_ACT:
+        return exec_act(exec);
+      case OP_WAIT_IDLE:
+        if (!exec.is_idle()) {
+          return false;
+        }
+        pc += 1;
+        return true;
+      case OP_WAIT_MS:
+        if (!has_operands(2)) {
+          return false;
+        }
+        return wait_until(false, read_u16(1), 3);
+      case OP_WAIT_GE:
+      case OP_WAIT_LT: {
+        if (!has_operands(5)) {
+          return false;
+        }
+        const int16_t v = read_source(program[pc + 1]);
+        const int16_t thresh = read_u16(2);
+        const bool met = (op == OP_WAIT_GE) ? (v >= thresh) : (v < thresh);
+        return wait_until(met, read_u16(4), 6);
+      }
+      case OP_LD:
+        if (!has_operands(2)) {
+          return false;
+        }
+        reg(1) = read_source(program[pc + 2]);
+        pc += 3;
+        return true;
+      case OP_LDI:
+      case OP_ADDI:
+      case OP_CMP_GE: {
+        if (!has_operands(3)) {
+          return false;
+        }
+        const int16_t imm = read_u16(2);
+        if (op == OP_LDI) {
+          reg(1) = imm;
+        } else if (op == OP_ADDI) {
+          reg(1) += imm;
+        } else {
+          flag = reg(1) >= imm;
+        }
+        pc += 4;
+        return true;
+      }
+      case OP_JMP:
+      case OP_JT:
+      case OP_JF: {
+        if (!has_operands(1)) {
+          return false;
+        }
+        const bool taken = (op == OP_JMP) || ((op == OP_JT) == flag);
+        pc = taken ? program[pc + 1] : pc + 2;
+        return true;
+      }
+      case OP_DJNZ:
+        if (!has_operands(2)) {
+          return false;
+        }
+        reg(1)--;
+        pc = (reg(1) != 0) ? program[pc + 2] : pc + 3;
+        return true;
+      case OP_EMIT:
+        if (!has_operands(1)) {
+          return false;
+        }
+        TWELITE_INFO(program[pc + 1], pc);  // program event {=u8} at {=u8}
+        pc += 2;
+        return true;
+      default:
+        TWELITE_ERROR(Cause_OVERMIND, op, pc);  // bad opcode {=u8} at {=u8}
+        running = false;
+        return false;
+    }
+  }
+
+  // ACT waits (without enqueueing anything) while the lane queue is full.
+  bool exec_act(ActionExecutorSingleton& exec) {
+    if (!has_operands(3)) {
+      return false;
+    }
+    const uint8_t num_tvs = program[pc + 3];
+    if (!has_operands(3 + 3 * num_tvs)) {
+      return false;
+    }
+    uint16_t dur_ms = read_u16(1);
+    if (dur_ms < 1) {
+      dur_ms = 1;
+    } else if (dur_ms > 5000) {
+      dur_ms = 5000;
+    }
+    Action action(dur_ms);
+    for (uint8_t i = 0; i < num_tvs; i++) {
+      const uint8_t offset = 4 + 3 * i;
+      const uint8_t target = program[pc + offset];
+      int16_t value = read_u16(offset + 1);
+      if (target & TARGET_FROM_REG) {
+        value = regs[value & (NUM_REGS - 1)];
+      }
+      if (!action.set_target(target & ~TARGET_FROM_REG, value)) {
+        TWELITE_ERROR(Cause_OVERMIND, target, pc);  // bad program target {=u8} at {=u8}
+        running = false;
+        return false;
+      }
+    }
+    if (exec.is_full(action.lane)) {
+      return false;
+    }
+    if (!exec.enqueue(action)) {
+      running = false;
+      return false;
+    }
+    pc += 4 + 3 * num_tvs;
+    return true;
+  }
+
+  // Common part of WAIT_*. Sets flag to whether the condition was met (vs
+  // timeout), and proceeds to next instruction (insn_size bytes ahead).
+  bool wait_until(bool met, uint16_t timeout_ms, uint8_t insn_size) {
+    if (!waiting) {
+      waiting = true;
+      wait_ms = timeout_ms;
+    }
+    if (!met && wait_ms > 0) {
+      wait_ms--;
+      return false;
+    }
+    waiting = false;
+    flag = met;
+    pc += insn_size;
+    return true;
+  }
+
+  // Stops the program (and returns 0) for unknown src.
+  int16_t read_source(uint8_t src) {
+    switch (src) {
+      case SRC_S0:
+        return sensor.get_sensor_t();
+      case SRC_S1:
+        return sensor.get_sensor_o();
+      case SRC_S2:
+        return sensor.get_sensor_x();
+      case SRC_RAIL_MARKERS:
+        return sensor.edge_o.get_num_edges();
+      case SRC_RAIL_POS:
+        return rail_position.get_position();
+      case SRC_ODOMETRY:
+        return odometry.get_rot();
+      case SRC_BAT_MV:
+        return sensor.get_bat_mv();
+      default:
+        TWELITE_ERROR(Cause_OVERMIND, src);  // bad program source: {=u8}
+        running = false;
+        return 0;
+    }
+  }
+
+  // Check that current instruction (with n operand bytes) is in the program.
+  // Stops the program otherwise.
+  bool has_operands(uint16_t n) {
+    if (pc + n >= size) {
+      TWELITE_ERROR(Cause_OVERMIND, pc);  // program counter out of range: {=u8}
+      running = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Register designated by operand at offset.
+  int16_t& reg(uint8_t offset) { return regs[program[pc + offset] % NUM_REGS]; }
+
+  uint16_t read_u16(uint8_t offset) const {
+    return program[pc + offset] | (program[pc + offset + 1] << 8);
+  }
+};
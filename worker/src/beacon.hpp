@@ -0,0 +1,89 @@
+#pragma once
+
+#include <proto/builder.pb.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shared_state.h"
+#include "tx_scheduler.h"
+
+// Fixed size digest of worker state, sent as BEACON packet.
+// Layout is in worker/README.md ("Beacon"). AVR is little endian.
+struct BeaconDigest {
+  static constexpr uint8_t FLAG_HELD = 1 << 2;
+  static constexpr uint8_t FLAG_JOGGING = 1 << 3;
+  static constexpr uint8_t FLAG_PROGRAM = 1 << 4;
+  static constexpr uint8_t FLAG_SEVERE = 1 << 5;
+
+  // bit 0-1: ExecStatus.Status, others: FLAG_*
+  uint8_t flags;
+  uint16_t running_seq;
+  uint16_t last_seq;
+  uint8_t queue_free;
+  // bat_mv / 32, saturates at 255.
+  uint8_t bat_mv_32;
+  uint16_t num_error_total;
+} __attribute__((packed));
+
+// Periodic BEACON sender, polled from main loop. Disabled by default.
+//
+// Each interval is jittered by +-1/8 period (and the first one is delayed by
+// up to a full period), with per-worker random sequence. So workers that got
+// the same period in a broadcast packet don't keep colliding.
+class Beacon {
+ public:
+  static constexpr uint16_t MIN_PERIOD_MS = 100;
+  // Jittered interval (up to +1/8) must fit in uint16_t.
+  static constexpr uint16_t MAX_PERIOD_MS = 58000;
+
+ private:
+  // 0 means disabled.
+  uint16_t period_ms = 0;
+  uint16_t last_ms = 0;
+  uint16_t interval_ms = 0;
+  // xorshift16 state. Never 0.
+  uint16_t rand = 1;
+
+ public:
+  void init(uint32_t seed) {
+    rand = static_cast<uint16_t>(seed ^ (seed >> 16)) | 1;
+  }
+
+  void set_period(uint16_t ms) {
+    period_ms = ms;
+    last_ms = millis();
+    interval_ms = (ms > 0) ? next_rand() % ms : 0;
+  }
+
+  // Returns true (and schedules the next one) when a beacon is due.
+  // The next one is delayed by 2^shift periods (on weak links).
+  bool take_due(uint8_t shift) {
+    if (period_ms == 0 ||
+        static_cast<uint16_t>(millis() - last_ms) < interval_ms) {
+      return false;
+    }
+    last_ms = millis();
+    uint32_t period = static_cast<uint32_t>(period_ms) << shift;
+    if (period > MAX_PERIOD_MS) {
+      period = MAX_PERIOD_MS;
+    }
+    const uint16_t spread = period / 4;
+    interval_ms = period - period / 8 + next_rand() % (spread + 1);
+    return true;
+  }
+
+  static void send(const BeaconDigest& digest) {
+    uint8_t buffer[1 + sizeof(BeaconDigest)];
+    buffer[0] = PacketType_BEACON;
+    memcpy(buffer + 1, &digest, sizeof(digest));
+    tx_scheduler.send(TX_TELEMETRY, buffer, sizeof(buffer));
+  }
+
+ private:
+  uint16_t next_rand() {
+    rand ^= rand << 7;
+    rand ^= rand >> 9;
+    rand ^= rand << 8;
+    return rand;
+  }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// Fixed EEPROM layout (1KB on ATmega328P). Records are placed at explicit
+// addresses instead of EEMEM, because EEMEM placement depends on build (link
+// order, which records are referenced) and a firmware update would read
+// another record's bytes. Each record has a version, so that erased EEPROM
+// (0xff) or an old layout reads as empty.
+//
+// Never move an existing record; add new ones after the last one.
+constexpr uint16_t EEPROM_MOTOR_LIMITS_ADDR = 0x000;
+constexpr uint16_t EEPROM_MOTOR_LIMITS_SIZE = 0x020;
+constexpr uint16_t EEPROM_MACROS_ADDR = 0x020;
+constexpr uint16_t EEPROM_MACROS_SIZE = 0x220;
+
+constexpr uint16_t EEPROM_SIZE = 0x400;
+static_assert(EEPROM_MACROS_ADDR + EEPROM_MACROS_SIZE <= EEPROM_SIZE,
+              "EEPROM layout overflows");
@@ -9,9 +9,26 @@ class DCMotor {
 
   static constexpr uint8_t REG_CONTROL = 0;
 
+  // Never a valid CONTROL value.
+  static constexpr uint8_t VALUE_UNKNOWN = 0xff;
+
+  // Retry interval of a failed write of the same value, in calls (ticks).
+  static constexpr uint8_t RETRY_INTERVAL = 100;
+
+  // Last CONTROL value successfully written.
+  uint8_t last_value = VALUE_UNKNOWN;
+  // Value of the last failed write, and calls to skip before retrying it.
+  uint8_t failed_value = VALUE_UNKNOWN;
+  uint8_t retry_wait = 0;
+
  public:
   DCMotor(uint8_t i2c_addr) : i2c_addr7b(i2c_addr) {}
 
+  // Only talks to the driver when quantized VSET (or direction) changes, so
+  // this can be called every tick. A failed write (e.g. dead driver) is
+  // retried every RETRY_INTERVAL calls while the same value is requested, so
+  // that I2C timeouts don't eat every tick. A different value (e.g. brake on
+  // STOP) is always written right away.
   void set_velocity(int8_t speed) {
     uint8_t abs_speed = (speed > 0) ? speed : (-speed);
     uint8_t value;
@@ -26,11 +43,26 @@ class DCMotor {
       value |=
           ((abs_speed << 1) & 0xfc);  // adjust scale & throw away lower 2 bits
     }
+    if (value == last_value) {
+      return;
+    }
+    if (value == failed_value && retry_wait > 0) {
+      retry_wait--;
+      return;
+    }
 
+    const uint8_t sreg = SREG;
     sei();  // w/o this, TWI gets stuck after sending start condtion.
-    I2c.write(i2c_addr7b, REG_CONTROL, value);
-    //   uint8_t res = Wire.endTransmission();
-    cli();
+    const uint8_t res = I2c.write(i2c_addr7b, REG_CONTROL, value);
+    SREG = sreg;
+    if (res == 0) {
+      last_value = value;
+      failed_value = VALUE_UNKNOWN;
+    } else {
+      last_value = VALUE_UNKNOWN;
+      failed_value = value;
+      retry_wait = RETRY_INTERVAL;
+    }
     return;
     /*
     if (res != 0) {
@@ -31,37 +31,22 @@ class Odometry {
     U16Be x, y, z;
   };
 
-  /**
-   * These constants are generated by following python code:
-   *
-   * COS: python -c "import math; print [int(math.cos(i/128.0*math.pi)*255) for
-   * i in range(64)]" SIN: python -c "import math; print
-   * [int(math.sin(i/128.0*math.pi)*255) for i in range(64)]"
-   */
-  static constexpr uint8_t QUAD_ANGLE = 64;
-  const uint8_t QUAD_COS[QUAD_ANGLE] = {
-      255, 254, 254, 254, 253, 253, 252, 251, 250, 248, 247, 245, 244,
-      242, 240, 237, 235, 233, 230, 227, 224, 221, 218, 215, 212, 208,
-      204, 201, 197, 193, 188, 184, 180, 175, 171, 166, 161, 156, 151,
-      146, 141, 136, 131, 125, 120, 114, 109, 103, 97,  91,  85,  79,
-      74,  68,  61,  55,  49,  43,  37,  31,  24,  18,  12,  6};
-
-  const uint8_t QUAD_SIN[QUAD_ANGLE] = {
-      0,   6,   12,  18,  24,  31,  37,  43,  49,  55,  61,  68,  74,
-      79,  85,  91,  97,  103, 109, 114, 120, 125, 131, 136, 141, 146,
-      151, 156, 161, 166, 171, 175, 180, 184, 188, 193, 197, 201, 204,
-      208, 212, 215, 218, 221, 224, 227, 230, 233, 235, 237, 240, 242,
-      244, 245, 247, 248, 250, 251, 252, 253, 253, 254, 254, 254};
-
  public:
+  // CORDIC atan2 is expected to finish within this many cycles.
+  static constexpr uint16_t ATAN2_CYCLE_BUDGET = 2000;
+
   bool init_success = false;
   int16_t vx = 0;
   int16_t vy = 0;
 
   // As seen from X+, CCW is positive (=forward)
-  uint8_t angle = 0;
+  // Full circle = 65536.
+  uint16_t angle = 0;
   int8_t num_rot = 0;
 
+  // Measurement started by the last poll(), to be read by the next one.
+  bool measuring = false;
+
   void init() {
     // Reset command.
     // I2c.write(addr, (uint8_t)0xf0);
@@ -90,12 +75,21 @@ class Odometry {
     }
   }
 
+  // Called from the tick, so it must not block. Reads the measurement
+  // started by the previous call (which has finished by then), and starts the
+  // next one.
   void poll() {
     if (!init_success) {
       return;
     }
+    if (measuring) {
+      measuring = false;
+      read_measurement();
+    }
+
+    // Start single measurement (X, Y, Z) command
     uint8_t status;
-    uint8_t code = I2c.read(addr, 0x3e, (uint8_t)1, &status);
+    const uint8_t code = I2c.read(addr, 0x3e, (uint8_t)1, &status);
     if (code != 0) {
       vx = 1000 + code;
       return;
@@ -104,13 +98,17 @@ class Odometry {
       vx = 2000 + status;
       return;
     }
-    delay(100);
+    measuring = true;
+  }
 
+ private:
+  void read_measurement() {
     // Read measurement command
     I2c.write(addr, (uint8_t)0x4e);
 
     ReadMeasurementResult result;
-    code = I2c.read(addr, 7, reinterpret_cast<uint8_t*>(&result));
+    const uint8_t code =
+        I2c.read(addr, 7, reinterpret_cast<uint8_t*>(&result));
     if (code != 0) {
       vx = 3000 + code;
       return;
@@ -126,9 +124,10 @@ class Odometry {
     }
     vx = decode_value(result.x);
     vy = decode_value(result.y);
-    const uint8_t new_angle = 256 - atan2(vx >> 8, vy >> 8);  // convert from sensor coords to human coords.
-    const uint8_t delta = new_angle - angle;
-    if (delta < 128) {
+    // convert from sensor coords to human coords.
+    const uint16_t new_angle = -atan2(vx, vy);
+    const uint16_t delta = new_angle - angle;
+    if (delta < 0x8000) {
       // real angle increased
       if (new_angle < angle) {
         num_rot++;  // overflown
@@ -142,7 +141,35 @@ class Odometry {
     angle = new_angle;
   }
 
-  int16_t get_rot() const { return ((int16_t)num_rot) * 256 + angle; }
+ public:
+  int16_t get_rot() const { return ((int16_t)num_rot) * 256 + (angle >> 8); }
+
+  // Measure average CORDIC atan2 cost (in CPU cycles, 8 cycle resolution),
+  // with interrupts disabled.
+  //
+  // Each call is timed separately with Timer1, so call ServoPWM::init first
+  // (prescaler 8, wraps at ICR1 every 20ms). A call is much shorter than a
+  // frame, so the counter wraps at most once.
+  uint16_t benchmark_atan2() const {
+    constexpr uint8_t N = 8;
+    constexpr uint8_t CLOCKS_PER_TIMER1_TICK = 8;
+    uint32_t ticks = 0;
+    uint16_t sum = 0;
+    for (uint8_t i = 0; i < N; i++) {
+      const uint8_t sreg = SREG;
+      cli();
+      const uint16_t t0 = TCNT1;
+      // Sweep through all quadrants, with full-scale and small vectors.
+      sum += atan2((i & 1) ? -30000 : 200, (i & 2) ? -77 : 31000 >> i);
+      const uint16_t t1 = TCNT1;
+      const uint16_t top = ICR1;
+      SREG = sreg;
+      ticks += (t1 >= t0) ? t1 - t0 : t1 + (top + 1) - t0;
+    }
+    // Prevent loop from being optimized away.
+    asm volatile("" : : "r"(sum));
+    return (ticks * CLOCKS_PER_TIMER1_TICK) / N;
+  }
 
  private:
   void write_reg(uint8_t mem_addr, uint16_t val) {
@@ -165,35 +192,58 @@ class Odometry {
     }
   }
 
-  // Returns angle of vector (x, y), in [0, 256).
-  // angle will be down-rounded.
-  uint8_t atan2(int8_t x, int8_t y) const {
-    if (y >= 0) {
-      return x >= 0 ? atan2_quad(x, y) : atan2_quad(y, -x) + QUAD_ANGLE;
-    } else {
-      return x >= 0 ? (atan2_quad(-y, x) + QUAD_ANGLE * 3)
-                    : (atan2_quad(-x, -y) + QUAD_ANGLE * 2);
+  // Returns angle of vector (x, y) (CCW from X+), full circle = 65536.
+  // Uses shift-add CORDIC (vectoring mode); error is within +-16 (~12 bit).
+  static uint16_t atan2(int16_t x, int16_t y) {
+    // Pre-rotate into right half-plane, and normalize magnitude to
+    // [4096, 8192) so that CORDIC gain (1.65x) never overflows int16.
+    uint16_t angle = 0;
+    if (x < 0) {
+      angle = 0x8000;
+      x = (x == INT16_MIN) ? INT16_MAX : -x;
+      y = (y == INT16_MIN) ? INT16_MAX : -y;
+    }
+    const uint16_t ay = (y >= 0) ? y : -y;
+    uint16_t mag = (static_cast<uint16_t>(x) > ay) ? x : ay;
+    if (mag == 0) {
+      return 0;
+    }
+    while (mag >= 8192) {
+      x >>= 1;
+      y >>= 1;
+      mag >>= 1;
+    }
+    while (mag < 4096) {
+      x <<= 1;
+      y <<= 1;
+      mag <<= 1;
     }
-  }
-
-  // Find angle of (x,y) using binary search.
-  // precondition: x >= 0 & y >= 0
-  uint8_t atan2_quad(uint8_t x, uint8_t y) const {
-    uint8_t ix_b = 0;
-    uint8_t ix_e = QUAD_ANGLE;
-
-    while (ix_b + 1 < ix_e) {
-      uint8_t ix_m = (ix_b + ix_e) >> 1;
 
-      // sin(i)/cos(i) > y/x   <=>  sin(i)*x > cos(i)*y
-      if (((uint16_t)QUAD_SIN[ix_m]) * x > ((uint16_t)QUAD_COS[ix_m]) * y) {
-        // (x,y) has smaller angle than ix_m.
-        ix_e = ix_m;
+    // Rotate (x, y) toward X+ axis, while accumulating rotated angle.
+    for (uint8_t i = 0; i < CORDIC_ITERATIONS; i++) {
+      const int16_t dx = y >> i;
+      const int16_t dy = x >> i;
+      const uint16_t da = cordic_atan_at(i);
+      if (y >= 0) {
+        x += dx;
+        y -= dy;
+        angle += da;
       } else {
-        // (x,y) has equal or greater angle than ix_m.
-        ix_b = ix_m;
+        x -= dx;
+        y += dy;
+        angle -= da;
       }
     }
-    return ix_b;
+    return angle;
+  }
+
+  static constexpr uint8_t CORDIC_ITERATIONS = 14;
+
+  // atan(2^-i), in full circle = 65536 units. Generated by:
+  // [round(math.atan(2**-i) * 65536 / (2 * math.pi)) for i in range(14)]
+  static uint16_t cordic_atan_at(uint8_t i) {
+    static const uint16_t CORDIC_ATAN[CORDIC_ITERATIONS] PROGMEM = {
+        8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5, 3, 1};
+    return pgm_read_word(&CORDIC_ATAN[i]);
   }
 };
@@ -1,8 +1,144 @@
 #pragma once
 
-// Perodically measure fixed number of ADC inputs & controls sensor
-// multiplexing. Each phase is 2ms.
+// Defined in wiring.c
+extern "C" volatile unsigned long timer0_overflow_count;
+
+// Timestamp in Timer0 ticks (64 clocks = 5.3us @ 12MHz).
+// Call with interrupts disabled.
+inline uint32_t timer0_ticks() {
+  uint8_t t = TCNT0;
+  uint32_t m = timer0_overflow_count;
+  if ((TIFR0 & _BV(TOV0)) && (t < 255)) {
+    m++;  // overflow ISR pending
+  }
+  return (m << 8) | t;
+}
+
+inline uint32_t timer0_ticks_to_us(uint32_t ticks) {
+  constexpr uint8_t CLOCKS_PER_US = F_CPU / 1000000L;
+  return (ticks / CLOCKS_PER_US) * 64 +
+         ((ticks % CLOCKS_PER_US) * 64) / CLOCKS_PER_US;
+}
+
+// Detects crossings of one ADC channel (e.g. rail markers) with hysteresis,
+// and timestamps rising edges. Fed with new samples from ADC ISR.
 //
+// Can be armed to "trip" after some number of rising edges, so that motors can
+// be stopped at the next tick, without waiting for polling.
+class EdgeDetector {
+ public:
+  // In 12 bit scale. (80mV @ 5V)
+  static constexpr uint16_t HYSTERESIS = 64;
+  static constexpr uint8_t NO_TRIP = 0xff;
+
+ private:
+  // Rising edge when value >= thresh. Falling edge when value < thresh -
+  // HYSTERESIS.
+  uint16_t thresh;
+  bool high = false;
+
+  uint16_t prev_value = 0;
+  uint32_t prev_ticks = 0;
+
+  volatile uint16_t num_edges = 0;
+  // Samples around the last rising edge (and thresh then). Crossing time is
+  // interpolated by get_last_edge_ticks(), to keep the ADC ISR short (a 32 bit
+  // divide would delay servo pulse ISRs by tens of us).
+  volatile uint16_t edge_thresh = 0;
+  volatile uint16_t edge_prev_value = 0;
+  volatile uint16_t edge_value = 0;
+  volatile uint32_t edge_prev_ticks = 0;
+  volatile uint32_t edge_ticks = 0;
+
+  // Trip when high, after this many more rising edges.
+  uint8_t trip_edges = NO_TRIP;
+  volatile bool tripped = false;
+
+ public:
+  EdgeDetector(uint16_t thresh) : thresh(thresh) {}
+
+  // Call from ADC ISR.
+  void feed(uint16_t value, uint32_t ticks) {
+    if (!high && value >= thresh) {
+      high = true;
+      num_edges++;
+      edge_thresh = thresh;
+      edge_prev_value = prev_value;
+      edge_value = value;
+      edge_prev_ticks = prev_ticks;
+      edge_ticks = ticks;
+      if (trip_edges != NO_TRIP && trip_edges > 0) {
+        trip_edges--;
+      }
+    } else if (high && value + HYSTERESIS < thresh) {
+      high = false;
+    }
+    if (high && trip_edges == 0) {
+      tripped = true;
+    }
+    prev_value = value;
+    prev_ticks = ticks;
+  }
+
+  // thresh: 12 bit scale.
+  void set_threshold(uint16_t new_thresh) {
+    const uint8_t sreg = SREG;
+    cli();
+    thresh = new_thresh;
+    high = prev_value >= thresh;
+    SREG = sreg;
+  }
+
+  // Trip when the signal is high, after num_edges rising edges.
+  // num_edges=0 means trip as soon as the signal is high. Trip is latched
+  // until re-armed, even if the signal goes low again. NO_TRIP disarms.
+  void arm_trip(uint8_t num_edges) {
+    const uint8_t sreg = SREG;
+    cli();
+    trip_edges = num_edges;
+    tripped = (num_edges == 0) && high;
+    SREG = sreg;
+  }
+
+  bool is_tripped() const { return tripped; }
+
+  uint16_t get_num_edges() const {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t n = num_edges;
+    SREG = sreg;
+    return n;
+  }
+
+  // Time of the last rising edge, linearly interpolated between the samples
+  // around it. Call from main loop (or tick), not from ISR.
+  uint32_t get_last_edge_ticks() const {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t th = edge_thresh;
+    const uint16_t v0 = edge_prev_value;
+    const uint16_t v1 = edge_value;
+    const uint32_t t0 = edge_prev_ticks;
+    const uint32_t t1 = edge_ticks;
+    SREG = sreg;
+
+    const uint32_t dt = t1 - t0;
+    if (dt > 0xffff || v1 <= v0 || th <= v0) {
+      return t1;  // previous sample too old (or not below thresh) to be useful
+    }
+    return t0 + (dt * (th - v0)) / (v1 - v0);
+  }
+};
+
+// Continuously measure fixed set of ADC inputs & controls sensor
+// multiplexing, driven by ADC conversion complete interrupt.
+//
+// Channels are measured in order of SCHEDULE. Each slot discards a few
+// conversions after switching mux (to let input settle) and then averages
+// 2^OVERSAMPLE_LOG2 conversions. All values are stored in 12 bit scale.
+//
+// With ADC clock = 12MHz / 64 (13 ADC clocks = 69us per conversion), rail
+// sensor (SEN_T) is updated about every 0.6ms, and battery every 5ms.
 class MultiplexedSensor {
  private:
   // Sensor channels.
@@ -12,103 +148,174 @@ class MultiplexedSensor {
   static const uint8_t I_SEN_X = 7;
   static const uint8_t I_INTERNAL_1V1REF = _BV(MUX3) | _BV(MUX2) | _BV(MUX1);
 
-  // Phase definitions.
-  const static uint8_t PHASE_SEN_T = 0;
-  const static uint8_t PHASE_SEN_O = 1;
-  const static uint8_t PHASE_SEN_X = 2;
-  const static uint8_t PHASE_AVCC = 3;
-  const static uint8_t PHASE_BAT = 4;
-  const static uint8_t NUM_PHASES = 5;
+  // Logical channels.
+  const static uint8_t CH_SEN_T = 0;
+  const static uint8_t CH_SEN_O = 1;
+  const static uint8_t CH_SEN_X = 2;
+  const static uint8_t CH_AVCC = 3;
+  const static uint8_t CH_BAT = 4;
+  const static uint8_t NUM_CHANNELS = 5;
+
+  // Rail sensor is 8x as frequent as battery & AVcc.
+  const static uint8_t SCHEDULE_LEN = 16;
+
+  const static uint8_t ADCSRA_PRESCALER_64 = _BV(ADPS2) | _BV(ADPS1);
+
+  // Rail marker threshold in 12 bit scale.
+  const static uint16_t MARKER_THRESH = 2048;
+
+  // Current slot in SCHEDULE.
+  uint8_t slot = 0;
+  uint8_t num_settle_left = 0;
+  uint8_t num_acc = 0;
+  uint16_t acc = 0;
 
-  uint8_t current_phase;
-  uint8_t phase_index;
-  const static uint8_t phase_length = 2;
+  // Written only by ADC ISR.
+  volatile uint16_t value_cache[NUM_CHANNELS];
+  volatile bool cycle_done = false;
 
-  uint16_t value_cache[NUM_PHASES];
+  // true during the tick right after SCHEDULE went around.
+  bool cycle_start = false;
 
  public:
-  MultiplexedSensor() : current_phase(PHASE_SEN_T), phase_index(0) {}
+  // Rail sensor (train cutoff). Threshold is set per Action.
+  EdgeDetector edge_t;
+  // Rail marker (SEN-O). Counts markers as incremental rail encoder.
+  EdgeDetector edge_o;
+
+  MultiplexedSensor() : edge_t(0xfff), edge_o(MARKER_THRESH) {}
+
+  // Start continuous conversion.
+  void init() {
+    slot = 0;
+    select_channel(schedule_at(slot));
+    ADCSRA = _BV(ADEN) | _BV(ADIE) | ADCSRA_PRESCALER_64 | _BV(ADSC);
+  }
 
   void loop1ms() {
-    phase_index++;
-    if (phase_index == 1) {
-      on_phase_middle();
-    } else if (phase_index >= phase_length) {
-      on_phase_end();
-
-      phase_index = 0;
-      current_phase = (current_phase + 1) % NUM_PHASES;
-      on_phase_begin();
+    cycle_start = cycle_done;
+    cycle_done = false;
+  }
+
+  // Call from ADC_vect ISR.
+  void on_conversion_complete() {
+    const uint16_t v = ADC;
+    const uint8_t ch = schedule_at(slot);
+    if (num_settle_left > 0) {
+      num_settle_left--;
+    } else {
+      acc += v;
+      num_acc++;
+      if (num_acc >= (1 << oversample_log2(ch))) {
+        const uint16_t value = acc << (2 - oversample_log2(ch));
+        value_cache[ch] = value;
+        if (ch == CH_SEN_T) {
+          edge_t.feed(value, timer0_ticks());
+        } else if (ch == CH_SEN_O) {
+          edge_o.feed(value, timer0_ticks());
+        }
+        next_slot(ch);
+      }
     }
+    ADCSRA |= _BV(ADSC);
   }
 
   // 0: 0V, 255: 5V ("max")
-  uint8_t get_sensor0() const { return value_cache[PHASE_SEN_T] >> 2; }
+  uint8_t get_sensor0() const { return read_value(CH_SEN_T) >> 4; }
 
-  uint8_t get_sensor1() const { return value_cache[PHASE_SEN_O] >> 2; }
+  uint8_t get_sensor1() const { return read_value(CH_SEN_O) >> 4; }
 
-  uint8_t get_sensor2() const { return value_cache[PHASE_SEN_X] >> 2; }
+  uint8_t get_sensor2() const { return read_value(CH_SEN_X) >> 4; }
 
   // DEPRECATED
-  uint8_t get_sensor_t() const { return value_cache[PHASE_SEN_T] >> 2; }
+  uint8_t get_sensor_t() const { return read_value(CH_SEN_T) >> 4; }
 
-  uint8_t get_sensor_o() const { return value_cache[PHASE_SEN_O] >> 2; }
+  uint8_t get_sensor_o() const { return read_value(CH_SEN_O) >> 4; }
 
-  uint8_t get_sensor_x() const { return value_cache[PHASE_SEN_X] >> 2; }
+  uint8_t get_sensor_x() const { return read_value(CH_SEN_X) >> 4; }
 
-  uint8_t get_sensor_v() const { return value_cache[PHASE_SEN_T] >> 2; }
+  uint8_t get_sensor_v() const { return read_value(CH_SEN_T) >> 4; }
 
   uint16_t get_bat_mv() const {
     // Vref = Vcc
     // Vadc = Vbat / 2 (halved by the resistors)
-    uint32_t t = value_cache[PHASE_BAT] * (get_vcc_mv() * 2L);
-    t /= 1024L;
+    uint32_t t = read_value(CH_BAT) * (get_vcc_mv() * 2L);
+    t /= 4096L;
     return t;
   }
 
   uint16_t get_vcc_mv() const {
-    uint32_t result = value_cache[PHASE_AVCC];
-    result = (1024L * 1100L) / result;  // Back-calculate AVcc in mV
+    uint32_t result = read_value(CH_AVCC);
+    if (result == 0) {
+      return 0;  // not measured yet
+    }
+    result = (4096L * 1100L) / result;  // Back-calculate AVcc in mV
     return result;
   }
 
-  uint8_t get_rate_ms() const { return NUM_PHASES * phase_length; }
-
-  bool is_start() const { return phase_index == 0 && current_phase == 0; }
+  bool is_start() const { return cycle_start; }
 
  private:
-  void on_phase_begin() {
-    // Connect AVcc to Vref.
-    ADMUX = _BV(REFS0);
-
-    switch (current_phase) {
-      case PHASE_SEN_T:
-        ADMUX |= I_SEN_T;
-        break;
-      case PHASE_SEN_O:
-        ADMUX |= I_SEN_O;
-        break;
-      case PHASE_SEN_X:
-        ADMUX |= I_SEN_X;
-        break;
-      case PHASE_AVCC:
-        ADMUX |= I_INTERNAL_1V1REF;
-      case PHASE_BAT:
-        ADMUX |= I_BAT;
-        break;
+  uint16_t read_value(uint8_t ch) const {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t v = value_cache[ch];
+    SREG = sreg;
+    return v;
+  }
+
+  void next_slot(uint8_t prev_ch) {
+    acc = 0;
+    num_acc = 0;
+    slot++;
+    if (slot >= SCHEDULE_LEN) {
+      slot = 0;
+      cycle_done = true;
+    }
+    const uint8_t ch = schedule_at(slot);
+    if (ch != prev_ch) {
+      select_channel(ch);
     }
   }
 
-  void on_phase_middle() {
-    // Start AD conversion.
-    ADCSRA |= _BV(ADSC);
+  void select_channel(uint8_t ch) {
+    // Connect AVcc to Vref.
+    ADMUX = _BV(REFS0) | mux_of(ch);
+    num_settle_left = num_settle(ch);
   }
 
-  void on_phase_end() {
-    if (!bit_is_set(ADCSRA, ADSC)) {
-      // ADCL needs to be read first to ensure consistency.
-      value_cache[current_phase] = ADCL;
-      value_cache[current_phase] |= ADCH << 8;
+  static uint8_t schedule_at(uint8_t slot) {
+    static const uint8_t SCHEDULE[SCHEDULE_LEN] PROGMEM = {
+        CH_SEN_T, CH_SEN_O, CH_SEN_T, CH_SEN_X, CH_SEN_T, CH_SEN_O,
+        CH_SEN_T, CH_AVCC,  CH_SEN_T, CH_SEN_O, CH_SEN_T, CH_SEN_X,
+        CH_SEN_T, CH_SEN_O, CH_SEN_T, CH_BAT};
+    return pgm_read_byte(&SCHEDULE[slot]);
+  }
+
+  static uint8_t mux_of(uint8_t ch) {
+    switch (ch) {
+      case CH_SEN_T:
+        return I_SEN_T;
+      case CH_SEN_O:
+        return I_SEN_O;
+      case CH_SEN_X:
+        return I_SEN_X;
+      case CH_AVCC:
+        return I_INTERNAL_1V1REF;
+      default:
+        return I_BAT;
     }
   }
+
+  // Conversions to discard after switching mux.
+  static uint8_t num_settle(uint8_t ch) {
+    // Bandgap reference needs much longer time to settle.
+    return (ch == CH_AVCC) ? 3 : 1;
+  }
+
+  // Up to 2 (i.e. 4x oversampling, 12 bit result).
+  static uint8_t oversample_log2(uint8_t ch) {
+    // Keep rail sensor latency low.
+    return (ch == CH_SEN_T) ? 1 : 2;
+  }
 };
@@ -0,0 +1,95 @@
+#pragma once
+
+// Servo pulse generator driven by 16 bit Timer1 (12MHz / 8 = 1.5 ticks/us),
+// with 20ms frame.
+//
+// Servo signals are wired to OC2A (PB3) and OC2B (PD3), which Timer1 can't
+// drive directly. So pins are set by the overflow ISR (frame start) and
+// cleared by compare match ISRs. OCR1x are double buffered by hardware
+// (updated at frame start), so pulses never glitch when width changes.
+// Pulse jitter = ISR latency; the 1ms tick runs with interrupts enabled
+// to keep it low. Other ISRs (ADC, UART RX, Timer0) must stay short (no
+// divides, no loops over buffers): each runs with interrupts disabled, and
+// delays a pulse edge by its whole length (a few us each).
+class ServoPWM {
+ public:
+  static constexpr uint8_t NUM_CHANNELS = 2;
+
+  // Safe range, equivalent to the old Timer2 based (85us resolution)
+  // position 10~33.
+  static constexpr uint16_t MIN_PULSE_US = 938;
+  static constexpr uint16_t MAX_PULSE_US = 2901;
+
+ private:
+  static constexpr uint16_t FRAME_US = 20000;
+  static constexpr uint8_t TICKS_PER_US_X2 = 2 * F_CPU / 8 / 1000000L;
+
+  // Fast PWM, TOP=ICR1 (mode 14), prescaler 8. Output pins disconnected.
+  static const uint8_t TCCR1A_FAST_PWM_ICR = _BV(WGM11);
+  static const uint8_t TCCR1B_FAST_PWM_ICR = _BV(WGM13) | _BV(WGM12);
+  static const uint8_t TCCR1B_PRESCALER_8 = _BV(CS11);
+
+ public:
+  void init(const uint16_t* pulse_us) {
+    // Set PWM ports as output.
+    DDRB |= _BV(3);  // PWMA
+    DDRD |= _BV(3);  // PWMB
+
+    const uint8_t sreg = SREG;
+    cli();
+    TCCR1B = 0;
+    TCCR1A = TCCR1A_FAST_PWM_ICR;
+    ICR1 = us_to_ticks(FRAME_US) - 1;
+    TCNT1 = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+      set_pulse_us(i, pulse_us[i]);
+    }
+    TIFR1 = _BV(TOV1) | _BV(OCF1A) | _BV(OCF1B);
+    TIMSK1 = _BV(TOIE1) | _BV(OCIE1A) | _BV(OCIE1B);
+    TCCR1B = TCCR1B_FAST_PWM_ICR | TCCR1B_PRESCALER_8;
+    SREG = sreg;
+  }
+
+  // Takes effect from the next frame.
+  void set_pulse_us(uint8_t ch, uint16_t us) {
+    if (us < MIN_PULSE_US) {
+      us = MIN_PULSE_US;
+    } else if (us > MAX_PULSE_US) {
+      us = MAX_PULSE_US;
+    }
+    const uint16_t ticks = us_to_ticks(us);
+
+    // 16 bit register write must not be interleaved.
+    const uint8_t sreg = SREG;
+    cli();
+    if (ch == 0) {
+      OCR1A = ticks;
+    } else {
+      OCR1B = ticks;
+    }
+    SREG = sreg;
+  }
+
+  // Call from TIMER1_OVF_vect ISR.
+  void on_frame_start() {
+    PORTB |= _BV(3);
+    PORTD |= _BV(3);
+  }
+
+  // Call from TIMER1_COMPA_vect ISR.
+  void on_pulse_end_a() { PORTB &= ~_BV(3); }
+
+  // Call from TIMER1_COMPB_vect ISR.
+  void on_pulse_end_b() { PORTD &= ~_BV(3); }
+
+  // Convert position of old Timer2 based PWM (prescaler 1024,
+  // pulse = (pos + 1) clocks) to pulse width.
+  static uint16_t legacy_pos_to_us(uint8_t pos) {
+    return ((pos + 1) * 1024UL * 1000UL) / (F_CPU / 1000L);
+  }
+
+ private:
+  static uint16_t us_to_ticks(uint16_t us) {
+    return (static_cast<uint32_t>(us) * TICKS_PER_US_X2) / 2;
+  }
+};
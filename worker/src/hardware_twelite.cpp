@@ -15,46 +15,56 @@ uint8_t warn_tx_buffer[80];
 #define SIGROW_SERNUM2 0x10
 #define SIGROW_SERNUM3 0x11
 
-#define TWELITE_ERROR_INTN(cause) \
-  send_checkpoint(Criticality_ERROR, cause, __LINE__, __FILE__)
-
-TweliteRecvStateMachine::TweliteRecvStateMachine() { reset(); }
-
-// This won't change after becoming DONE_, unless reset() is called.
-TweliteRecvStateMachine::State TweliteRecvStateMachine::get_state() const {
-  return state;
+TweliteRecvStateMachine::TweliteRecvStateMachine()
+    : state(WAITING_HEADER_COLON) {}
+
+void TweliteRecvStateMachine::set_device_id(uint32_t id) {
+  const uint8_t sreg = SREG;
+  cli();
+  device_id = id;
+  SREG = sreg;
 }
 
-bool TweliteRecvStateMachine::is_done() const { return (uint8_t)state & 0x10; }
-
-MaybeSlice TweliteRecvStateMachine::get_buffer() {
+MaybeSlice TweliteRecvStateMachine::Frame::get_buffer() {
   if (state != State::DONE_OK) {
     return MaybeSlice();
   } else {
-    return MaybeSlice(buffer, size_done);
+    return MaybeSlice(buffer, size);
+  }
+}
+
+TweliteRecvStateMachine::Frame* TweliteRecvStateMachine::peek() {
+  if (read_ix == write_ix) {
+    return nullptr;
   }
+  return &frames[read_ix & (NUM_SLOTS - 1)];
 }
 
-// Need to call this to start getting another packet, after get_state()
-// becomes DONE_*.
-void TweliteRecvStateMachine::reset() { state = WAITING_HEADER_COLON; }
+void TweliteRecvStateMachine::pop() {
+  if (read_ix == write_ix) {
+    return;
+  }
+  // Don't let compiler move frame reads after releasing the slot.
+  asm volatile("" ::: "memory");
+  read_ix++;
+}
 
 void TweliteRecvStateMachine::feed(char c) {
+  Frame& frame = frames[write_ix & (NUM_SLOTS - 1)];
   if (state == WAITING_HEADER_COLON) {
     if (c == ':') {
       state = FIRST_NIBBLE;
       size_done = 0;
+      discarding = static_cast<uint8_t>(write_ix - read_ix) >= NUM_SLOTS;
     }
   } else if (state == FIRST_NIBBLE) {
     if (c == '\r' || c == '\n') {
-      state = DONE_OK;
-      g_twelite_packet_recv_done = true;
+      finish_frame(DONE_OK);
       return;
     }
     uint8_t nibble = decode_nibble(c);
     if (nibble == INVALID_NIBBLE) {
-      state = DONE_ERR_INVALID;
-      g_twelite_packet_recv_done = true;
+      finish_frame(DONE_ERR_INVALID);
     } else {
       state = SECOND_NIBBLE;
       byte_temp = nibble << 4;
@@ -62,19 +72,108 @@ void TweliteRecvStateMachine::feed(char c) {
   } else {
     uint8_t nibble = decode_nibble(c);
     if (nibble == INVALID_NIBBLE) {
-      state = DONE_ERR_INVALID;
-      g_twelite_packet_recv_done = true;
+      finish_frame(DONE_ERR_INVALID);
     } else {
       state = FIRST_NIBBLE;
-      buffer[size_done++] = byte_temp | nibble;
+      if (!discarding) {
+        frame.buffer[size_done] = byte_temp | nibble;
+      }
+      if (size_done < HEAD_SIZE) {
+        head[size_done] = byte_temp | nibble;
+      }
+      size_done++;
       if (size_done >= BUFFER_SIZE) {
-        state = DONE_ERR_OVERFLOW;
-        g_twelite_packet_recv_done = true;
+        finish_frame(DONE_ERR_OVERFLOW);
       }
     }
   }
 }
 
+void TweliteRecvStateMachine::finish_frame(State end_state) {
+  state = WAITING_HEADER_COLON;
+  if (end_state == DONE_OK && (take_emergency() || take_tx_report())) {
+    return;
+  }
+  if (discarding) {
+    num_dropped++;
+    return;
+  }
+  Frame& frame = frames[write_ix & (NUM_SLOTS - 1)];
+  frame.state = end_state;
+  frame.size = size_done;
+  // Frame content must be complete before publishing it.
+  asm volatile("" ::: "memory");
+  write_ix++;
+
+  const uint8_t num_queued = write_ix - read_ix;
+  if (num_queued > high_water) {
+    high_water = num_queued;
+  }
+}
+
+bool TweliteRecvStateMachine::take_emergency() {
+  if (head[0] != 0x00) {
+    return false;
+  }
+  // Frame is header + payload + checksum(1).
+  uint8_t offset;
+  if (head[1] == 0x01 &&
+      size_done == SIMPLE_HEADER_SIZE + EMERGENCY_PAYLOAD_SIZE + 1) {
+    offset = SIMPLE_HEADER_SIZE;
+  } else if (head[1] == 0xA0 &&
+             size_done == EXTENDED_HEADER_SIZE + EMERGENCY_PAYLOAD_SIZE + 1) {
+    offset = EXTENDED_HEADER_SIZE;
+  } else {
+    return false;
+  }
+  const uint8_t* payload = head + offset;
+  if (payload[4] != CommandType_EMERGENCY) {
+    return false;
+  }
+  const uint32_t addr = (static_cast<uint32_t>(payload[0]) << 24) |
+                        (static_cast<uint32_t>(payload[1]) << 16) |
+                        (static_cast<uint32_t>(payload[2]) << 8) | payload[3];
+  if (addr != device_id && addr != 0xffffffff /* broadcast */) {
+    return false;
+  }
+  g_emergency_op = payload[5];
+  g_emergency_ticks = timer0_ticks();
+  return true;
+}
+
+bool TweliteRecvStateMachine::take_tx_report() {
+  if (size_done != TX_REPORT_FRAME_SIZE || head[0] != 0xDB ||
+      head[1] != 0xA1) {
+    return false;
+  }
+  // head[2] is response ID, which can't be specified in simple format.
+  // Results arrive in transmit order, so they're just counted.
+  if (head[3] != 0) {
+    if (num_tx_ok < 0xff) {
+      num_tx_ok++;
+    }
+  } else {
+    if (num_tx_fail < 0xff) {
+      num_tx_fail++;
+    }
+  }
+  return true;
+}
+
+void TweliteRecvStateMachine::take_tx_reports(uint8_t& num_ok,
+                                              uint8_t& num_fail) {
+  num_ok = num_tx_ok;
+  num_fail = num_tx_fail;
+  num_tx_ok = 0;
+  num_tx_fail = 0;
+}
+
+uint16_t TweliteRecvStateMachine::get_num_dropped() const {
+  return num_dropped;
+}
+
+uint8_t TweliteRecvStateMachine::get_high_water() const { return high_water; }
+
 // returns: [0, 15] for valid nibble, otherwise INVALID_NIBBLE.
 uint8_t TweliteRecvStateMachine::decode_nibble(char c) {
   if ('0' <= c && c <= '9') {
@@ -87,6 +186,7 @@ uint8_t TweliteRecvStateMachine::decode_nibble(char c) {
 }
 
 void TweliteInterface::init() {
+  recv_sm.set_device_id(get_device_id());
   Serial.begin(38400);
   Serial.set_recv_callback(&recv_sm, &cb);
 }
@@ -103,31 +203,31 @@ uint32_t TweliteInterface::get_device_id() {
          (static_cast<uint32_t>(boot_signature_byte_get(SIGROW_SERNUM3)) << 24);
 }
 
-void TweliteInterface::restart_recv() {
-  g_twelite_packet_recv_done = false;
-  recv_sm.reset();
-}
+bool TweliteInterface::is_recv_avail() { return recv_sm.peek() != nullptr; }
+
+void TweliteInterface::pop_recv() { recv_sm.pop(); }
 
 MaybeSlice TweliteInterface::get_datagram() {
-  if (!recv_sm.is_done()) {
+  TweliteRecvStateMachine::Frame* frame = recv_sm.peek();
+  if (frame == nullptr) {
     return MaybeSlice();
   }
 
-  switch (recv_sm.get_state()) {
+  switch (frame->state) {
     case TweliteRecvStateMachine::State::DONE_OK:
       break;
     case TweliteRecvStateMachine::State::DONE_ERR_INVALID:
       num_invalid_packet++;
       return MaybeSlice();
     case TweliteRecvStateMachine::State::DONE_ERR_OVERFLOW:
-      TWELITE_ERROR_INTN(Cause_OVERMIND);
+      TWELITE_ERROR(Cause_OVERMIND);  // RX buffer overflow
       return MaybeSlice();
 
     default:
-      TWELITE_ERROR_INTN(Cause_OVERMIND);  // shouldn't reach here.
+      TWELITE_ERROR(Cause_OVERMIND);  // shouldn't reach here.
       return MaybeSlice();
   }
-  MaybeSlice packet = recv_sm.get_buffer();
+  MaybeSlice packet = frame->get_buffer();
   packet = validate_and_extract_modbus(packet);
   packet = validate_and_extract_overmind(packet);
   if (packet.size > 0) {
@@ -153,25 +253,6 @@ void TweliteInterface::send_datagram(const uint8_t* ptr, uint8_t size) {
   serial_write_cstr_blocking("X\r\n");
 }
 
-void TweliteInterface::send_checkpoint(Criticality criticality, Cause cause,
-                                       uint16_t line, const char* filename) {
-  Checkpoint cp;
-  cp.criticality = criticality;
-  cp.cause = cause;
-  cp.at_line = line;
-  strncpy(cp.file, filename, sizeof(cp.file));
-
-  uint8_t buffer[28];
-  buffer[0] = PacketType_CHECKPOINT;
-  pb_ostream_t stream =
-      pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
-  if (pb_encode(&stream, Checkpoint_fields, &cp)) {
-    send_datagram(buffer, 1 + stream.bytes_written);
-  } else {
-    // don't do anything, because it might cause infinite error loop.
-  }
-}
-
 uint32_t TweliteInterface::get_data_bytes_sent() const {
   return data_bytes_sent;
 }
@@ -188,6 +269,26 @@ uint16_t TweliteInterface::get_num_invalid_packet() const {
   return num_invalid_packet;
 }
 
+uint16_t TweliteInterface::get_num_dropped_frame() const {
+  uint8_t sreg = SREG;
+  cli();
+  const uint16_t num_dropped = recv_sm.get_num_dropped();
+  SREG = sreg;
+  return num_dropped;
+}
+
+uint8_t TweliteInterface::get_recv_queue_high_water() const {
+  return recv_sm.get_high_water();
+}
+
+void TweliteInterface::take_tx_reports(uint8_t& num_ok, uint8_t& num_fail) {
+  uint8_t sreg = SREG;
+  cli();
+  recv_sm.take_tx_reports(num_ok, num_fail);
+  SREG = sreg;
+  link_quality.on_tx_results(num_ok, num_fail);
+}
+
 void TweliteInterface::send_u32_be(uint32_t v) {
   send_byte(v >> 24);
   send_byte((v >> 16) & 0xff);
@@ -196,7 +297,7 @@ void TweliteInterface::send_u32_be(uint32_t v) {
 }
 
 // TWELITE-Modbus level check. We only accept valid ASCII packets with
-// origin=0x00, command=0x01
+// origin=0x00, command=0x01 (simple format) or 0xA0 (extended format)
 MaybeSlice TweliteInterface::validate_and_extract_modbus(
     MaybeSlice modbus_packet) {
   if (!modbus_packet.is_valid()) {
@@ -206,15 +307,23 @@ MaybeSlice TweliteInterface::validate_and_extract_modbus(
   // Filter / validate.
   // 3 = target(1) + command(1) + data(N) + checksum(1)
   if (modbus_packet.size < 3) {
-    TWELITE_ERROR_INTN(Cause_OVERMIND);  // too small to be valid
+    TWELITE_ERROR(Cause_OVERMIND);  // too small to be valid
     return MaybeSlice();
   }
-  if (modbus_packet.ptr[0] != 0x00 || modbus_packet.ptr[1] != 0x01) {
+  if (modbus_packet.ptr[0] != 0x00) {
     // There are so many noisy packets (e.g. auto-local echo), we shouldn't
     // treat them as warning.
     return MaybeSlice();
   }
-  return modbus_packet.trim(2, 1);
+  if (modbus_packet.ptr[1] == 0x01) {
+    return modbus_packet.trim(2, 1);
+  }
+  if (modbus_packet.ptr[1] == 0xA0 &&
+      modbus_packet.size >= EXTENDED_HEADER_SIZE + 1) {
+    link_quality.on_lqi(modbus_packet.ptr[EXTENDED_LQI_OFFSET]);
+    return modbus_packet.trim(EXTENDED_HEADER_SIZE, 1);
+  }
+  return MaybeSlice();
 }
 
 MaybeSlice TweliteInterface::validate_and_extract_overmind(
@@ -225,16 +334,54 @@ MaybeSlice TweliteInterface::validate_and_extract_overmind(
 
   // OvmPacket = <Addr : 4> <datagram>
   if (ovm_packet.size < 4) {
-    TWELITE_ERROR_INTN(Cause_OVERMIND);  // address required but not found
+    TWELITE_ERROR(Cause_OVERMIND);  // address required but not found
     return MaybeSlice();
   }
   uint32_t addr = ovm_packet.u32_be();
-  if (addr != get_device_id() && addr != 0xffffffff) {
+  if (addr == ADDR_MULTICAST) {
+    return extract_multicast_section(ovm_packet.trim(4, 0));
+  }
+  if (addr != get_device_id() && addr != ADDR_BROADCAST) {
     return MaybeSlice();
   }
   return ovm_packet.trim(4, 0);
 }
 
+// McastPacket = <N : 1> (<Addr : 4> <Offset : 1> <Size : 1>)*N <Payload>
+// Offset is relative to the beginning of Payload. Sections can overlap, so
+// workers executing the same command can share one section.
+MaybeSlice TweliteInterface::extract_multicast_section(
+    MaybeSlice mcast_packet) {
+  if (mcast_packet.size < 1) {
+    TWELITE_ERROR(Cause_OVERMIND);  // address table size not found
+    return MaybeSlice();
+  }
+  const uint8_t num_entries = mcast_packet.ptr[0];
+  const uint16_t table_size =
+      static_cast<uint16_t>(num_entries) * MULTICAST_ENTRY_SIZE;
+  if (1 + table_size > mcast_packet.size) {
+    TWELITE_ERROR(Cause_OVERMIND);  // truncated address table
+    return MaybeSlice();
+  }
+  MaybeSlice payload = mcast_packet.slice(1 + table_size);
+
+  const uint32_t device_id = get_device_id();
+  for (uint8_t i = 0; i < num_entries; i++) {
+    MaybeSlice entry = mcast_packet.slice(1 + i * MULTICAST_ENTRY_SIZE);
+    if (entry.u32_be() != device_id) {
+      continue;
+    }
+    const uint8_t offset = entry.ptr[4];
+    const uint8_t size = entry.ptr[5];
+    if (static_cast<uint16_t>(offset) + size > payload.size) {
+      TWELITE_ERROR(Cause_OVERMIND);  // section out of payload
+      return MaybeSlice();
+    }
+    return MaybeSlice(payload.ptr + offset, size);
+  }
+  return MaybeSlice();
+}
+
 void TweliteInterface::send_byte(uint8_t v) {
   serial_write_byte_blocking(format_half_byte(v >> 4));
   serial_write_byte_blocking(format_half_byte(v & 0xf));
@@ -1,17 +1,45 @@
 #pragma once
 
 #include <proto/builder.pb.h>
+#include "link_quality.hpp"
+#include "logging.h"
 #include "slice.hpp"
 
 extern uint8_t async_tx_buffer[80];
 extern uint8_t warn_tx_buffer[80];
 
-// Parse ":..." ASCII messages from standard TWELITE MWAPP.
+// Parse ":..." ASCII messages from standard TWELITE MWAPP, into a queue of
+// frames. Frames are produced by USART RX ISR (feed) and consumed by main loop
+// (peek / pop), as lock-free single-producer single-consumer queue. Thus new
+// frames can arrive while main loop is processing older ones.
+//
+// Emergency commands (CommandType_EMERGENCY) are recognized here in the ISR
+// and bypass the queue (even when it's full), so that they're applied by the
+// next tick regardless of what main loop is doing.
+//
+// Transmit results reported by the module itself (":DBA1...") are also
+// counted here, instead of being queued.
 class TweliteRecvStateMachine {
  private:
   static constexpr uint8_t BUFFER_SIZE = 120;
 
+  // addr(4) + '!'(1) + op(1)
+  static constexpr uint8_t EMERGENCY_PAYLOAD_SIZE = 6;
+  // Header before the payload. target(1) + command(1) in simple format, and
+  // 14 bytes (see TweliteInterface) in extended format.
+  static constexpr uint8_t SIMPLE_HEADER_SIZE = 2;
+  static constexpr uint8_t EXTENDED_HEADER_SIZE = 14;
+  static constexpr uint8_t HEAD_SIZE =
+      EXTENDED_HEADER_SIZE + EMERGENCY_PAYLOAD_SIZE;
+
+  // 0xDB(1) + 0xA1(1) + response id(1) + result(1) + checksum(1)
+  static constexpr uint8_t TX_REPORT_FRAME_SIZE = 5;
+
  public:
+  // Must be power of 2. 2 is enough to receive the next frame while main
+  // loop handles one, and each slot costs 120+ bytes of RAM (see README).
+  static constexpr uint8_t NUM_SLOTS = 2;
+
   enum State : uint8_t {
     WAITING_HEADER_COLON = 0,
 
@@ -25,32 +53,79 @@ class TweliteRecvStateMachine {
     DONE_ERR_OVERFLOW = 0x12,
   };
 
- private:
-  volatile State state;
+  struct Frame {
+    // One of DONE_*.
+    State state;
+    uint8_t size;
+    uint8_t buffer[BUFFER_SIZE];
 
+    // Returns decoded bytes if DONE_OK, otherwise empty slice.
+    MaybeSlice get_buffer();
+  };
+
+ private:
+  // Parser state. Returns to WAITING_HEADER_COLON after each frame.
+  State state;
+  // True when current frame is being dropped because the queue is full.
+  bool discarding = false;
   uint8_t size_done = 0;
-  uint8_t buffer[BUFFER_SIZE];
   uint8_t byte_temp = 0;
 
+  // First bytes of current frame, kept even when discarding.
+  uint8_t head[HEAD_SIZE];
+  uint32_t device_id = 0;
+
+  Frame frames[NUM_SLOTS];
+
+  // Free-running indices. write_ix is only written by feed(), read_ix is only
+  // written by pop().
+  volatile uint8_t write_ix = 0;
+  volatile uint8_t read_ix = 0;
+
+  volatile uint16_t num_dropped = 0;
+  volatile uint8_t high_water = 0;
+
+  // Transmit results since last take_tx_reports().
+  volatile uint8_t num_tx_ok = 0;
+  volatile uint8_t num_tx_fail = 0;
+
   static constexpr uint8_t INVALID_NIBBLE = 0xff;
 
  public:
   TweliteRecvStateMachine();
 
-  // This won't change after becoming DONE_, unless reset() is called.
-  State get_state() const;
-
-  bool is_done() const;
+  // Address to accept emergency commands for (in addition to broadcast).
+  void set_device_id(uint32_t id);
 
-  MaybeSlice get_buffer();
+  // Returns oldest received frame, or nullptr if there's none.
+  // Frame stays valid until pop() is called.
+  Frame* peek();
 
-  // Need to call this to start getting another packet, after get_state()
-  // becomes DONE_*.
-  void reset();
+  // Discard oldest received frame.
+  void pop();
 
+  // Call from USART RX ISR.
   void feed(char c);
 
+  // Number of frames dropped because the queue was full.
+  uint16_t get_num_dropped() const;
+
+  // Max number of frames that has been in the queue at once.
+  uint8_t get_high_water() const;
+
+  // Get & clear number of transmit results. Call with interrupts disabled.
+  void take_tx_reports(uint8_t& num_ok, uint8_t& num_fail);
+
  private:
+  void finish_frame(State end_state);
+
+  // Returns true (and sets g_emergency_op) if current frame is emergency
+  // command for this device.
+  bool take_emergency();
+
+  // Returns true (and counts it) if current frame is transmit result.
+  bool take_tx_report();
+
   // returns: [0, 15] for valid nibble, otherwise INVALID_NIBBLE.
   static uint8_t decode_nibble(char c);
 };
@@ -65,9 +140,20 @@ class TweliteInterface {
   uint16_t num_invalid_packet = 0;
 
   TweliteRecvStateMachine recv_sm;
+  LinkQuality link_quality;
 
   enum class RecvResult : uint8_t { OK, OVERFLOW, INVALID };
 
+  static constexpr uint32_t ADDR_BROADCAST = 0xffffffff;
+  static constexpr uint32_t ADDR_MULTICAST = 0xfffffffe;
+  // Size of one (addr, offset, size) entry in multicast address table.
+  static constexpr uint8_t MULTICAST_ENTRY_SIZE = 6;
+
+  // src(1) + command(1) + response id(1) + src addr(4) + dst addr(4) + LQI(1)
+  // + length(2)
+  static constexpr uint8_t EXTENDED_HEADER_SIZE = 14;
+  static constexpr uint8_t EXTENDED_LQI_OFFSET = 11;
+
  public:
   void init();
 
@@ -75,40 +161,50 @@ class TweliteInterface {
 
   uint32_t get_device_id();
 
-  void restart_recv();
+  // True if there's some received frame to be processed by get_datagram().
+  bool is_recv_avail();
 
-  /** Returns datagram if DONE_OK and packet is valid, otherwise returns empty slice. */
+  /** Returns datagram if oldest frame is DONE_OK and packet is valid, otherwise returns empty slice. */
   MaybeSlice get_datagram();
 
+  // Need to call this after processing get_datagram() to get next frame.
+  // Invalidates datagram returned by get_datagram().
+  void pop_recv();
+
   // Send specified buffer.
   // Ideally size<=80 bytes to fit in one packet.
   void send_datagram(const uint8_t* ptr, uint8_t size);
-  void send_checkpoint(Criticality criticality, Cause cause, uint16_t line, const char* filename);
 
   uint32_t get_data_bytes_sent() const;
   uint32_t get_data_bytes_recv() const;
   uint16_t get_num_valid_packet() const;
   uint16_t get_num_invalid_packet() const;
+  uint16_t get_num_dropped_frame() const;
+  uint8_t get_recv_queue_high_water() const;
+
+  // Get & clear number of transmit results (success / failure) reported by
+  // the module since last call. They're also fed to link quality.
+  void take_tx_reports(uint8_t& num_ok, uint8_t& num_fail);
+
+  const LinkQuality& get_link_quality() const { return link_quality; }
 
  private:
   void send_u32_be(uint32_t v);
 
   // TWELITE-Modbus level check. We only accept valid ASCII packets with
-  // origin=0x00, command=0x01
+  // origin=0x00, command=0x01 (simple format) or 0xA0 (extended format, LQI
+  // is recorded)
   MaybeSlice validate_and_extract_modbus(MaybeSlice modbus_packet);
 
   MaybeSlice validate_and_extract_overmind(MaybeSlice ovm_packet);
 
+  // Find this worker's section in multicast packet body (after the address).
+  // Returns empty slice when this worker is not listed.
+  MaybeSlice extract_multicast_section(MaybeSlice mcast_packet);
+
   void send_byte(uint8_t v);
 
   inline void serial_write_cstr_blocking(const char* p);
   inline void serial_write_byte_blocking(uint8_t v);
   inline static char format_half_byte(uint8_t v);
 };
-
-#define TWELITE_INFO() \
-  twelite.send_checkpoint(Criticality_INFO, Cause_LOGIC, __LINE__, __FILE__)
-#define TWELITE_ERROR(cause) \
-  twelite.send_checkpoint(Criticality_ERROR, cause, __LINE__, __FILE__)
-#define TWELITE_SEVERE(cause) \
-  twelite.send_checkpoint(Criticality_SEVERE, cause, __LINE__, __FILE__)
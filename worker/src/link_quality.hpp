@@ -0,0 +1,81 @@
+#pragma once
+
+#include <proto/builder.pb.h>
+#include <stdint.h>
+
+// Link quality of this worker, estimated from LQI of received packets (only
+// available when the parent sends in extended format) and transmit results
+// reported by the module.
+//
+// Telemetry is scaled down on weak links, so that a worker at the edge of
+// coverage doesn't saturate the channel with retries.
+class LinkQuality {
+ public:
+  enum Level : uint8_t { LINK_STRONG, LINK_FAIR, LINK_WEAK };
+
+  static constexpr uint8_t NUM_LQI_BUCKETS = 4;
+
+ private:
+  // Received packets per LQI range of 64. Saturate at 0xffff.
+  uint16_t lqi_hist[NUM_LQI_BUCKETS] = {};
+  // Moving average (1/8 weight of new sample). Valid when has_lqi.
+  uint8_t lqi_avg = 0;
+  bool has_lqi = false;
+
+  // Moving average of transmit failure ratio (1/8 weight of new sample), in
+  // 1/256.
+  uint8_t tx_error_rate = 0;
+
+ public:
+  void on_lqi(uint8_t lqi) {
+    uint16_t& count = lqi_hist[lqi / (256 / NUM_LQI_BUCKETS)];
+    if (count < 0xffff) {
+      count++;
+    }
+    lqi_avg = has_lqi ? ewma(lqi_avg, lqi) : lqi;
+    has_lqi = true;
+  }
+
+  void on_tx_results(uint8_t num_ok, uint8_t num_fail) {
+    for (uint8_t i = 0; i < num_ok; i++) {
+      tx_error_rate = ewma(tx_error_rate, 0);
+    }
+    for (uint8_t i = 0; i < num_fail; i++) {
+      tx_error_rate = ewma(tx_error_rate, 255);
+    }
+  }
+
+  Level get_level() const {
+    if (tx_error_rate > 64 || (has_lqi && lqi_avg < 50)) {
+      return LINK_WEAK;
+    } else if (tx_error_rate > 26 || (has_lqi && lqi_avg < 100)) {
+      return LINK_FAIR;
+    }
+    return LINK_STRONG;
+  }
+
+  // Telemetry periods are multiplied by 2^(this).
+  uint8_t get_telemetry_shift() const { return get_level(); }
+
+  // Preferred max payload of multi-field packets. Smaller packets are less
+  // likely to be lost on weak links.
+  uint8_t get_preferred_payload_size() const {
+    static const uint8_t SIZES[] = {79, 60, 40};
+    return SIZES[get_level()];
+  }
+
+  void fill_status(LinkStatus& status) const {
+    status.lqi_hist_count = NUM_LQI_BUCKETS;
+    for (uint8_t i = 0; i < NUM_LQI_BUCKETS; i++) {
+      status.lqi_hist[i] = lqi_hist[i];
+    }
+    status.lqi_avg = lqi_avg;
+    status.tx_error_rate = tx_error_rate;
+    status.level = static_cast<LinkStatus_Level>(get_level());
+  }
+
+ private:
+  static uint8_t ewma(uint8_t avg, uint8_t sample) {
+    return avg + (static_cast<int16_t>(sample) - avg) / 8;
+  }
+};
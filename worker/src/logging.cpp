@@ -0,0 +1,92 @@
+#include "logging.h"
+
+#include <Arduino.h>
+#include <nanopb/pb_encode.h>
+
+#include "shared_state.h"
+#include "tx_scheduler.h"
+
+Logger logger;
+ErrorCounterRegistry error_counters;
+
+void Logger::flush_if_needed() {
+  if (size == 0 && num_dropped == 0) {
+    return;
+  }
+  if (size < RING_SIZE / 2 &&
+      static_cast<uint16_t>(now_ms() - oldest_record_ms) < FLUSH_INTERVAL_MS) {
+    return;
+  }
+
+  // LogPacket = <PacketType : 1> <num dropped : 1> <records : N>
+  uint8_t buffer[2 + RING_SIZE];
+  uint8_t buffer_size;
+  {
+    const uint8_t sreg = SREG;
+    cli();
+    buffer[0] = PacketType_LOG;
+    buffer[1] = num_dropped;
+    memcpy(buffer + 2, ring, size);
+    buffer_size = 2 + size;
+    size = 0;
+    num_dropped = 0;
+    SREG = sreg;
+  }
+  tx_scheduler.send(TX_EVENT, buffer, buffer_size);
+}
+
+uint16_t Logger::now_ms() { return millis(); }
+
+void ErrorCounterRegistry::flush_if_needed() {
+  if (static_cast<uint16_t>(millis() - last_flush_ms) < FLUSH_INTERVAL_MS) {
+    return;
+  }
+  last_flush_ms = millis();
+
+  bool any = num_overflow > 0;
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    any |= slots[i].count > 0;
+  }
+  if (any) {
+    flush(TX_TRACE);
+  }
+}
+
+void ErrorCounterRegistry::flush(TxClass cls) {
+  // Slots are split into multiple packets when they don't fit in one.
+  uint8_t slot_ix = 0;
+  do {
+    ErrorCounters counters = ErrorCounters_init_default;
+    {
+      const uint8_t sreg = SREG;
+      cli();
+      for (; slot_ix < NUM_SLOTS &&
+             counters.counter_count < MAX_COUNTERS_PER_PACKET;
+           slot_ix++) {
+        Slot& slot = slots[slot_ix];
+        if (slot.count > 0) {
+          ErrorCounter& counter = counters.counter[counters.counter_count++];
+          counter.site_id = slot.site_id;
+          counter.count = slot.count;
+          slot.count = 0;
+        }
+      }
+      counters.num_total = num_total;
+      if (slot_ix == NUM_SLOTS) {
+        counters.num_overflow = num_overflow;
+        num_overflow = 0;
+      }
+      SREG = sreg;
+    }
+
+    uint8_t buffer[80];
+    buffer[0] = PacketType_ERROR_COUNTERS;
+    pb_ostream_t stream =
+        pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
+    if (pb_encode(&stream, ErrorCounters_fields, &counters)) {
+      tx_scheduler.send(cls, buffer, 1 + stream.bytes_written);
+    } else {
+      // don't count it, because it might cause infinite error loop.
+    }
+  } while (slot_ix < NUM_SLOTS);
+}
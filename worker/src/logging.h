@@ -0,0 +1,208 @@
+#pragma once
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdint.h>
+
+#include "tx_scheduler.h"
+
+// Deferred-format logging.
+//
+// A log site only records its 16-bit site ID and raw argument bytes into a
+// small ring. Message, criticality, cause and argument layout of each site
+// live in a host-side table (build/log_table.json), generated at build time
+// by gen_log_table.py from the source. Message is the trailing comment of the
+// log site, and its "{=u8}"-style placeholders define the argument layout:
+//
+//   TWELITE_ERROR(Cause_OVERMIND, dur_ms);  // dur capped to 5s: {=i16}
+//
+// Each log site must fit in one line, and argument types must match the
+// placeholders exactly.
+
+// Site ID = FNV-1a of "<basename of file>" + line (LE 16 bit), folded to 16
+// bit. Must be kept in sync with gen_log_table.py.
+constexpr uint16_t log_site_id(const char* path, uint16_t line) {
+  const char* base = path;
+  for (const char* p = path; *p != 0; p++) {
+    if (*p == '/') {
+      base = p + 1;
+    }
+  }
+  uint32_t h = 2166136261UL;
+  for (const char* p = base; *p != 0; p++) {
+    h = (h ^ static_cast<uint8_t>(*p)) * 16777619UL;
+  }
+  h = (h ^ (line & 0xff)) * 16777619UL;
+  h = (h ^ (line >> 8)) * 16777619UL;
+  return (h >> 16) ^ (h & 0xffff);
+}
+
+class Logger {
+ public:
+  // Must fit in one datagram together with the LOG packet header.
+  static constexpr uint8_t RING_SIZE = 48;
+
+  // Flush at least this frequently while there's some record.
+  static constexpr uint16_t FLUSH_INTERVAL_MS = 50;
+
+ private:
+  uint8_t ring[RING_SIZE];
+  volatile uint8_t size = 0;
+
+  // Number of records dropped because ring was full, since last flush.
+  volatile uint8_t num_dropped = 0;
+
+  // millis() when the oldest record in the ring was written.
+  volatile uint16_t oldest_record_ms = 0;
+
+ public:
+  // Safe to call from both ISR and main loop.
+  template <uint16_t SITE_ID, typename... Args>
+  void write(Args... args) {
+    const uint8_t record_size = sizeof(SITE_ID) + args_size(args...);
+
+    const uint8_t sreg = SREG;
+    cli();
+    if (size + record_size > RING_SIZE) {
+      if (num_dropped < 0xff) {
+        num_dropped++;
+      }
+    } else {
+      if (size == 0) {
+        oldest_record_ms = now_ms();
+      }
+      put(SITE_ID, args...);
+    }
+    SREG = sreg;
+  }
+
+  // Send buffered records as a LOG packet, if it's time to do so.
+  // Call from main loop only.
+  void flush_if_needed();
+
+ private:
+  static uint16_t now_ms();
+
+  static constexpr uint8_t args_size() { return 0; }
+
+  template <typename T, typename... Rest>
+  static constexpr uint8_t args_size(T v, Rest... rest) {
+    return sizeof(T) + args_size(rest...);
+  }
+
+  void put() {}
+
+  // Raw bytes in AVR native (little) endian.
+  template <typename T, typename... Rest>
+  void put(T v, Rest... rest) {
+    for (uint8_t i = 0; i < sizeof(T); i++) {
+      ring[size++] = v & 0xff;
+      v >>= 8;
+    }
+    put(rest...);
+  }
+};
+
+extern Logger logger;
+
+// Counts ERROR/SEVERE occurrences per log site, so that error storms (e.g.
+// malformed 20-action enqueue) cost O(1) each and don't flood the log ring.
+// Only the first occurrence of a site since last flush is logged with its
+// arguments. Sites that collide with another one in the table share a single
+// overflow count, and only the first collision is logged. Counts are sent as
+// one ERROR_COUNTERS packet periodically, or when requested.
+class ErrorCounterRegistry {
+ public:
+  static constexpr uint8_t NUM_SLOTS = 16;
+
+  // Must be <= ErrorCounters.counter max_count. Each ErrorCounter takes up to
+  // 10 bytes when encoded, so 7 of them fit in one packet.
+  static constexpr uint8_t MAX_COUNTERS_PER_PACKET = 7;
+
+  // Flush period while there's some non-zero counter.
+  static constexpr uint16_t FLUSH_INTERVAL_MS = 1000;
+
+ private:
+  struct Slot {
+    uint16_t site_id;
+    // 0 means unused slot. Saturates at 0xff.
+    uint8_t count;
+  };
+
+  Slot slots[NUM_SLOTS];
+
+  // Occurrences of sites that collided with other site in the slot.
+  volatile uint8_t num_overflow = 0;
+
+  // Total number of errors since reset. Wraps around.
+  volatile uint16_t num_total = 0;
+
+  // Latched when any SEVERE happens.
+  volatile bool severe = false;
+
+  uint16_t last_flush_ms = 0;
+
+ public:
+  // Safe to call from both ISR and main loop.
+  template <uint16_t SITE_ID, bool SEVERE, typename... Args>
+  void count(Args... args) {
+    Slot& slot = slots[SITE_ID % NUM_SLOTS];
+    bool first = false;
+
+    const uint8_t sreg = SREG;
+    cli();
+    num_total++;
+    if (SEVERE) {
+      severe = true;
+    }
+    if (slot.count == 0) {
+      slot.site_id = SITE_ID;
+      slot.count = 1;
+      first = true;
+    } else if (slot.site_id == SITE_ID) {
+      if (slot.count < 0xff) {
+        slot.count++;
+      }
+    } else {
+      // Only the first collision since last flush is logged, so that a
+      // frequent colliding site doesn't flood the log.
+      first = num_overflow == 0;
+      if (num_overflow < 0xff) {
+        num_overflow++;
+      }
+    }
+    SREG = sreg;
+
+    if (first) {
+      logger.write<SITE_ID>(args...);
+    }
+  }
+
+  uint16_t get_num_total() const {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t n = num_total;
+    SREG = sreg;
+    return n;
+  }
+
+  bool is_severe() const { return severe; }
+
+  // Send ERROR_COUNTERS packet & clear counters if it's time to do so.
+  // Call from main loop only.
+  void flush_if_needed();
+
+  // Send ERROR_COUNTERS packet (as cls) & clear counters now.
+  // Call from main loop only.
+  void flush(TxClass cls);
+};
+
+extern ErrorCounterRegistry error_counters;
+
+#define TWELITE_LOG_SITE_ID() log_site_id(__FILE__, __LINE__)
+
+#define TWELITE_INFO(...) logger.write<TWELITE_LOG_SITE_ID()>(__VA_ARGS__)
+#define TWELITE_ERROR(cause, ...) \
+  error_counters.count<TWELITE_LOG_SITE_ID(), false>(__VA_ARGS__)
+#define TWELITE_SEVERE(cause, ...) \
+  error_counters.count<TWELITE_LOG_SITE_ID(), true>(__VA_ARGS__)
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <avr/eeprom.h>
+#include <stdint.h>
+
+#include "eeprom_layout.h"
+
+// Action macros stored in EEPROM, so that the host can upload frequently
+// used action sequences once and invoke them by ID.
+//
+// Macro body is an action list in human readable format (worker/README.md),
+// which can refer to invocation arguments as "$0"~"$3".
+// e.g. body "$0t$1T20,300a13" invoked as x2(1000;-50)
+//   -> "1000t-50T20,300a13"
+class MacroStore {
+ public:
+  static constexpr uint8_t NUM_MACROS = 8;
+  static constexpr uint8_t MAX_BODY_SIZE = 63;
+  static constexpr uint8_t MAX_ARGS = 4;
+
+ private:
+  struct Slot {
+    // 0xff (erased) or 0 means empty.
+    uint8_t size;
+    char body[MAX_BODY_SIZE];
+  };
+
+  struct Record {
+    // Erased EEPROM (0xff) or old layout means all macros are empty.
+    static constexpr uint8_t VERSION = 1;
+
+    uint8_t version;
+    Slot slots[NUM_MACROS];
+  };
+  static_assert(sizeof(Record) <= EEPROM_MACROS_SIZE,
+                "MacroStore doesn't fit in EEPROM layout");
+
+  static Record* eeprom_record() {
+    return reinterpret_cast<Record*>(EEPROM_MACROS_ADDR);
+  }
+
+  static Slot* eeprom_slots() { return eeprom_record()->slots; }
+
+  static bool is_valid() {
+    return eeprom_read_byte(&eeprom_record()->version) == Record::VERSION;
+  }
+
+ public:
+  // Takes a few ms per byte (EEPROM write), only for changed bytes.
+  bool store(uint8_t id, const uint8_t* body, uint8_t size) {
+    if (id >= NUM_MACROS || size > MAX_BODY_SIZE) {
+      return false;
+    }
+    if (!is_valid()) {
+      // Clear other macros before they become visible.
+      for (uint8_t i = 0; i < NUM_MACROS; i++) {
+        eeprom_update_byte(&eeprom_slots()[i].size, 0);
+      }
+      eeprom_update_byte(&eeprom_record()->version, Record::VERSION);
+    }
+    Slot* slot = &eeprom_slots()[id];
+    eeprom_update_block(body, slot->body, size);
+    eeprom_update_byte(&slot->size, size);
+    return true;
+  }
+
+  // Expand macro into out (of out_capacity bytes), substituting "$n" with
+  // args[n] in decimal. Returns expanded size, or 0 when the macro is empty
+  // or the result doesn't fit.
+  uint8_t expand(uint8_t id, const int16_t* args, uint8_t num_args,
+                 uint8_t* out, uint8_t out_capacity) const {
+    if (id >= NUM_MACROS || !is_valid()) {
+      return 0;
+    }
+    const Slot* slot = &eeprom_slots()[id];
+    const uint8_t size = eeprom_read_byte(&slot->size);
+    if (size == 0 || size > MAX_BODY_SIZE) {
+      return 0;
+    }
+
+    uint8_t out_size = 0;
+    for (uint8_t i = 0; i < size; i++) {
+      const char c = eeprom_read_byte(
+          reinterpret_cast<const uint8_t*>(&slot->body[i]));
+      if (c == '$' && i + 1 < size) {
+        const uint8_t arg_ix =
+            eeprom_read_byte(
+                reinterpret_cast<const uint8_t*>(&slot->body[i + 1])) -
+            '0';
+        if (arg_ix < num_args) {
+          i++;
+          if (!append_int(args[arg_ix], out, out_capacity, out_size)) {
+            return 0;
+          }
+          continue;
+        }
+      }
+      if (out_size >= out_capacity) {
+        return 0;
+      }
+      out[out_size++] = c;
+    }
+    return out_size;
+  }
+
+ private:
+  static bool append_int(int16_t v, uint8_t* out, uint8_t out_capacity,
+                         uint8_t& out_size) {
+    char digits[6];
+    uint8_t n = 0;
+    uint16_t abs_v = (v < 0) ? static_cast<uint16_t>(-(v + 1)) + 1 : v;
+    do {
+      digits[n++] = '0' + (abs_v % 10);
+      abs_v /= 10;
+    } while (abs_v > 0);
+    if (out_size + n + (v < 0 ? 1 : 0) > out_capacity) {
+      return false;
+    }
+    if (v < 0) {
+      out[out_size++] = '-';
+    }
+    while (n > 0) {
+      out[out_size++] = digits[--n];
+    }
+    return true;
+  }
+};
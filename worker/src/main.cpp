@@ -5,9 +5,16 @@
 #include <proto/builder.pb.h>
 
 #include "action.hpp"
+#include "action_vm.hpp"
+#include "beacon.hpp"
+#include "macro_store.hpp"
 #include "shared_state.h"
+#include "tx_scheduler.h"
 
 ActionExecutorSingleton g_actions;
+MacroStore g_macros;
+ActionVM g_vm;
+Beacon g_beacon;
 
 int16_t convert_acc(int16_t raw) {
   return (static_cast<int32_t>(raw) * 61) / 1000;
@@ -28,6 +35,13 @@ void fill_sensor_status(SensorStatus& status) {
 
   status.optical_rail = sensor.get_sensor2();
   status.odometry_rail = odometry.get_rot();
+
+  status.rail_marker_count = sensor.edge_o.get_num_edges();
+  status.rail_marker_last_us =
+      timer0_ticks_to_us(sensor.edge_o.get_last_edge_ticks());
+
+  status.rail_pos = rail_position.get_position();
+  status.rail_pos_confidence = rail_position.get_confidence();
 }
 
 class CommandHandler {
@@ -35,14 +49,22 @@ class CommandHandler {
   MaybeSlice datagram;  // dependent on buffer inside twelite.
   int r_ix;
 
-  uint8_t buffer[80];
+  // Reply buffers are local to the commands that send them, so that they're
+  // not on the stack while parsing actions.
+  static constexpr uint8_t TX_BUFFER_SIZE = 80;
+  static constexpr uint8_t MACRO_EXPAND_SIZE = 96;
+
+  // true while parsing expanded macro body (in place of datagram).
+  bool in_macro = false;
+  // true while enqueueing to the shadow plan.
+  bool shadow = false;
 
  public:
   CommandHandler(MaybeSlice datagram) : datagram(datagram), r_ix(0) {}
 
   void handle() {
     r_ix = 0;
-    indicator.flash_blocking();
+    indicator.flash();
     uint8_t code = read();
     switch (code) {
       case CommandType_PRINT_STATUS:
@@ -54,11 +76,44 @@ class CommandHandler {
       case CommandType_ENQUEUE:
         exec_enqueue();
         break;
+      case CommandType_ENQUEUE_SHADOW:
+        shadow = true;
+        exec_enqueue();
+        break;
+      case CommandType_SWAP_PLAN:
+        exec_swap_plan();
+        break;
+      case CommandType_JOG:
+        exec_jog();
+        break;
       case CommandType_READ_SENSOR:
         exec_read_sensor();
         break;
+      case CommandType_CONFIG_BEACON:
+        exec_config_beacon();
+        break;
+      case CommandType_READ_ERROR_COUNTERS:
+        error_counters.flush(TX_REPLY);
+        break;
+      case CommandType_CONFIG_MOTOR:
+        exec_config_motor();
+        break;
+      case CommandType_DEFINE_MACRO:
+        exec_define_macro();
+        break;
+      case CommandType_RUN_PROGRAM:
+        exec_run_program();
+        break;
+      case CommandType_EDIT_QUEUE:
+        exec_edit_queue();
+        break;
+      case CommandType_EMERGENCY:
+        // Usually handled by RX ISR. Only ones in multicast packets reach
+        // here.
+        exec_emergency();
+        break;
       default:
-        TWELITE_ERROR(Cause_OVERMIND);  // unknown command
+        TWELITE_ERROR(Cause_OVERMIND, code);  // unknown command: {=u8}
         break;
     }
   }
@@ -102,6 +157,21 @@ class CommandHandler {
     }
   }
 
+  // Action seq (0~65535).
+  uint16_t parse_seq() {
+    uint16_t v = 0;
+    while (available()) {
+      char c = read();
+      if ('0' <= c && c <= '9') {
+        v = v * 10 + (c - '0');
+      } else {
+        unread(c);
+        break;
+      }
+    }
+    return v;
+  }
+
   int16_t parse_int() {
     bool positive = !consume('-');
     int16_t v = 0;
@@ -119,43 +189,248 @@ class CommandHandler {
 
  private:  // Command Handler
   void exec_enqueue() {
+    // Both would enqueue to the same queue in unpredictable order.
+    if (g_vm.is_running()) {
+      TWELITE_ERROR(Cause_OVERMIND);  // enqueue rejected while program is running
+      return;
+    }
+    // All or nothing, so that a sequence is never cut in the middle.
+    uint8_t num_actions[N_LANES] = {};
+    count_actions(num_actions);
+    if (!g_actions.has_room(num_actions)) {
+      TWELITE_ERROR(Cause_OVERMIND);  // enqueue rejected, not enough queue space
+      return;
+    }
     while (true) {
       enqueue_single_action();
       if (!consume(',')) {
         break;
       }
     }
-    TWELITE_INFO();  // Enqueue executed.
+    TWELITE_INFO(g_actions.get_last_seq());  // Enqueue executed. last seq: {=u16}
   }
 
-  void exec_print() {
-    {
-      Status status;
-      g_actions.fill_status(status);
+  void exec_jog() {
+    if (consume('D')) {
+      int16_t ms = parse_int();
+      if (ms < 20) {
+        TWELITE_ERROR(Cause_OVERMIND, ms);  // jog deadman capped to 20ms: {=i16}
+        ms = 20;
+      } else if (ms > 2000) {
+        TWELITE_ERROR(Cause_OVERMIND, ms);  // jog deadman capped to 2s: {=i16}
+        ms = 2000;
+      }
+      g_actions.set_jog_deadman(ms);
+      return;
+    }
+    Action setpoint;
+    if (read_jog_targets(setpoint)) {
+      g_actions.jog(setpoint);
+    }
+  }
 
-      buffer[0] = PacketType_STATUS;
-      pb_ostream_t stream =
-          pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
-      if (pb_encode(&stream, Status_fields, &status)) {
-        twelite.send_datagram(buffer, 1 + stream.bytes_written);
-      } else {
-        TWELITE_ERROR(Cause_LOGIC_RT);
+  // (Target Value)+ of servo / motor targets only. Returns false (with error)
+  // when other targets are found, so that a bad jog is never applied.
+  bool read_jog_targets(Action& setpoint) {
+    do {
+      const char target = read();
+      switch (target) {
+        case 'A':
+        case 'B':
+        case 'a':
+        case 'b':
+        case 't':
+        case 'o':
+        case 's':
+          setpoint.set_target(target, parse_int());
+          break;
+        default:
+          TWELITE_ERROR(Cause_OVERMIND, target);  // not a jog target: {=u8}
+          return false;
       }
+    } while (available());
+    return true;
+  }
+
+  void exec_swap_plan() {
+    if (consume('-')) {
+      g_actions.discard_shadow_plan();
+    } else if (available()) {
+      g_actions.swap_plan_after(parse_seq());
+    } else {
+      g_actions.swap_plan();
     }
-    delay(10);
-    {
-      IOStatus status;
-      fill_io_status(status);
+  }
 
-      buffer[0] = PacketType_IO_STATUS;
-      pb_ostream_t stream =
-          pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
-      if (pb_encode(&stream, IOStatus_fields, &status)) {
-        twelite.send_datagram(buffer, 1 + stream.bytes_written);
-      } else {
-        TWELITE_ERROR(Cause_LOGIC_RT);
+  void exec_edit_queue() {
+    const char op = read();
+    const uint16_t seq = parse_seq();
+    if (op == 't') {
+      g_actions.truncate_after(seq);
+      return;
+    }
+    if (op != 'r' && op != 'i') {
+      TWELITE_ERROR(Cause_OVERMIND, op);  // unknown queue edit: {=u8}
+      return;
+    }
+    if (!consume(':')) {
+      TWELITE_ERROR(Cause_OVERMIND);  // queue edit w/o action
+      return;
+    }
+    const Action action = read_action();
+    if (op == 'r') {
+      g_actions.replace(seq, action);
+    } else if (g_actions.insert_before(seq, action)) {
+      TWELITE_INFO(g_actions.get_last_seq());  // inserted seq: {=u16}
+    }
+  }
+
+  void exec_emergency() {
+    const uint8_t op = read();
+    const uint8_t sreg = SREG;
+    cli();
+    g_emergency_op = op;
+    g_emergency_ticks = timer0_ticks();
+    SREG = sreg;
+  }
+
+  // Bits of PRINT_STATUS field mask, in StatusReport field order.
+  enum StatusField : uint8_t {
+    SF_SYSTEM,
+    SF_EXEC,
+    SF_QUEUE,
+    SF_SENSOR,
+    SF_OUTPUT,
+    SF_COUNTERS,
+    SF_LINK,
+    N_STATUS_FIELDS
+  };
+
+  // Send selected fields as StatusReport. Fields are packed into as few
+  // packets (of preferred size for current link quality) as possible; a field
+  // that doesn't fit goes to the next packet.
+  void exec_print() {
+    uint8_t mask = (1 << N_STATUS_FIELDS) - 1;
+    if (available()) {
+      mask = parse_int();
+    }
+
+    const uint8_t max_payload =
+        twelite.get_link_quality().get_preferred_payload_size();
+    uint8_t buffer[TX_BUFFER_SIZE];
+    pb_ostream_t stream = begin_status_report(buffer, max_payload);
+    const size_t header_size = stream.bytes_written;
+    for (uint8_t field = 0; field < N_STATUS_FIELDS; field++) {
+      if ((mask & (1 << field)) == 0 || append_status_field(stream, field)) {
+        continue;
+      }
+      if (stream.bytes_written > header_size) {
+        tx_scheduler.send(TX_REPLY, buffer, 1 + stream.bytes_written);
+        stream = begin_status_report(buffer, max_payload);
+        if (append_status_field(stream, field)) {
+          continue;
+        }
+      }
+      // Field alone is bigger than preferred size.
+      stream.max_size = sizeof(buffer) - 1;
+      if (!append_status_field(stream, field)) {
+        TWELITE_ERROR(Cause_LOGIC_RT, field);  // status field too big: {=u8}
       }
     }
+    tx_scheduler.send(TX_REPLY, buffer, 1 + stream.bytes_written);
+  }
+
+  // Each packet starts with worker_type, so that it can be decoded alone.
+  pb_ostream_t begin_status_report(uint8_t* buffer, uint8_t max_payload) {
+    buffer[0] = PacketType_STATUS_REPORT;
+    const uint8_t size =
+        (max_payload < TX_BUFFER_SIZE - 1) ? max_payload : TX_BUFFER_SIZE - 1;
+    pb_ostream_t stream = pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), size);
+    pb_encode_tag(&stream, PB_WT_VARINT, StatusReport_worker_type_tag);
+    pb_encode_varint(&stream, WorkerType_BUILDER);
+    return stream;
+  }
+
+  // Returns false (without writing anything) when the field doesn't fit.
+  bool append_status_field(pb_ostream_t& stream, uint8_t field) {
+    // Only one of them is filled at a time, to save stack.
+    union {
+      SystemStatus system;
+      ExecStatus exec;
+      QueueStatus queue;
+      SensorStatus sensor;
+      OutputStatus output;
+      ErrorCounterSummary counters;
+      LinkStatus link;
+    } sub;
+    const pb_field_t* fields;
+    switch (field) {
+      case SF_SYSTEM:
+        sub.system = SystemStatus_init_default;
+        g_actions.fill_status_system(sub.system);
+        fields = SystemStatus_fields;
+        break;
+      case SF_EXEC:
+        sub.exec = ExecStatus_init_default;
+        g_actions.fill_status_exec(sub.exec);
+        fields = ExecStatus_fields;
+        break;
+      case SF_QUEUE:
+        sub.queue = QueueStatus_init_default;
+        g_actions.fill_status_queue(sub.queue);
+        fields = QueueStatus_fields;
+        break;
+      case SF_SENSOR:
+        sub.sensor = SensorStatus_init_default;
+        fill_sensor_status(sub.sensor);
+        fields = SensorStatus_fields;
+        break;
+      case SF_OUTPUT:
+        sub.output = OutputStatus_init_default;
+        g_actions.fill_output_status(sub.output);
+        fields = OutputStatus_fields;
+        break;
+      case SF_COUNTERS:
+        sub.counters.num_total = error_counters.get_num_total();
+        sub.counters.severe = error_counters.is_severe();
+        fields = ErrorCounterSummary_fields;
+        break;
+      default:
+        twelite.get_link_quality().fill_status(sub.link);
+        fields = LinkStatus_fields;
+        break;
+    }
+
+    // StatusReport fields are numbered from 2, in StatusField order.
+    static_assert(StatusReport_link_tag == StatusReport_system_tag + SF_LINK,
+                  "StatusField must match StatusReport");
+    const uint8_t tag = StatusReport_system_tag + field;
+    size_t size;
+    if (!pb_get_encoded_size(&size, fields, &sub)) {
+      TWELITE_ERROR(Cause_LOGIC_RT, field);  // status field encode failed: {=u8}
+      return true;
+    }
+    // tag (1) + length (1) + payload
+    if (stream.bytes_written + 2 + size > stream.max_size) {
+      return false;
+    }
+    pb_encode_tag(&stream, PB_WT_STRING, tag);
+    pb_encode_submessage(&stream, fields, &sub);
+    return true;
+  }
+
+  void exec_config_beacon() {
+    int16_t period_ms = parse_int();
+    if (period_ms < 0) {
+      TWELITE_ERROR(Cause_OVERMIND, period_ms);  // negative beacon period: {=i16}
+      return;
+    }
+    const int16_t min_ms = Beacon::MIN_PERIOD_MS;
+    if (period_ms > 0 && period_ms < min_ms) {
+      TWELITE_ERROR(Cause_OVERMIND, period_ms);  // beacon period capped to 100ms: {=i16}
+      period_ms = Beacon::MIN_PERIOD_MS;
+    }
+    g_beacon.set_period(period_ms);
   }
 
   void exec_read_sensor() {
@@ -172,57 +447,240 @@ class CommandHandler {
     g_async_sensor_since_last_sent_ms = 0;
   }
 
+  void exec_config_motor() {
+    const int16_t ix = parse_int();
+    if (ix < 0 || ix >= N_MOTORS) {
+      TWELITE_ERROR(Cause_OVERMIND, ix);  // unknown motor: {=i16}
+      return;
+    }
+    MotorRamp::Limits limits = g_actions.motor_ramps[ix].get_limits();
+    bool persist = false;
+    while (available()) {
+      const char key = read();
+      switch (key) {
+        case 'a':
+          limits.max_acc = safe_read_limit();
+          break;
+        case 'j':
+          limits.max_jerk = safe_read_limit();
+          break;
+        case 'w':
+          persist = true;
+          break;
+        default:
+          TWELITE_ERROR(Cause_OVERMIND, key);  // unknown motor config: {=u8}
+          return;
+      }
+    }
+    g_actions.set_motor_limits(ix, limits, persist);
+  }
+
+  // (id) ':' (body: rest of the command)
+  void exec_define_macro() {
+    const int16_t id = parse_int();
+    if (!consume(':')) {
+      TWELITE_ERROR(Cause_OVERMIND);  // macro w/o body
+      return;
+    }
+    if (id < 0 || id >= MacroStore::NUM_MACROS) {
+      TWELITE_ERROR(Cause_OVERMIND, id);  // macro id out of range: {=i16}
+      return;
+    }
+    if (!g_macros.store(id, datagram.ptr + r_ix, datagram.size - r_ix)) {
+      TWELITE_ERROR(Cause_OVERMIND, id);  // macro store failed: {=i16}
+    }
+  }
+
+  // Body is raw bytecode (see ActionVM).
+  void exec_run_program() {
+    const uint8_t size = datagram.size - r_ix;
+    if (!g_vm.load(datagram.ptr + r_ix, size)) {
+      TWELITE_ERROR(Cause_OVERMIND, size);  // program too big: {=u8}
+    }
+  }
+
   void exec_scan() {
     I2CScanResult result;
     g_actions.fill_i2c_scan_result(result);
 
+    uint8_t buffer[TX_BUFFER_SIZE];
     buffer[0] = PacketType_I2C_SCAN_RESULT;
     pb_ostream_t stream =
         pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
     if (pb_encode(&stream, I2CScanResult_fields, &result)) {
-      twelite.send_datagram(buffer, 1 + stream.bytes_written);
+      tx_scheduler.send(TX_REPLY, buffer, 1 + stream.bytes_written);
     } else {
-      TWELITE_ERROR(Cause_LOGIC_RT);
+      TWELITE_ERROR(Cause_LOGIC_RT);  // I2CScanResult encode failed
+    }
+  }
+
+  // (id) ('(' (arg (';' arg)*)? ')')?
+  void enqueue_macro() {
+    uint8_t expanded[MACRO_EXPAND_SIZE];
+    const uint8_t size = read_macro_call(expanded, false);
+    if (size == 0) {
+      return;
+    }
+
+    // Parse expanded body in place of the datagram.
+    const MaybeSlice outer = datagram;
+    const int outer_r_ix = r_ix;
+    datagram = MaybeSlice(expanded, size);
+    r_ix = 0;
+    in_macro = true;
+    while (true) {
+      enqueue_single_action();
+      if (!consume(',')) {
+        break;
+      }
     }
+    in_macro = false;
+    datagram = outer;
+    r_ix = outer_r_ix;
+  }
+
+  // Reads "id(args)" after 'x', and expands the macro into expanded. Returns
+  // expanded size, or 0 when the call is invalid (reported unless quiet).
+  uint8_t read_macro_call(uint8_t* expanded, bool quiet) {
+    if (in_macro) {
+      if (!quiet) {
+        TWELITE_ERROR(Cause_OVERMIND);  // nested macro
+      }
+      return 0;
+    }
+    const int16_t id = parse_int();
+    int16_t args[MacroStore::MAX_ARGS];
+    uint8_t num_args = 0;
+    if (consume('(') && !consume(')')) {
+      do {
+        if (num_args >= MacroStore::MAX_ARGS) {
+          if (!quiet) {
+            TWELITE_ERROR(Cause_OVERMIND, id);  // too many macro args: {=i16}
+          }
+          return 0;
+        }
+        args[num_args++] = parse_int();
+      } while (consume(';'));
+      if (!consume(')')) {
+        if (!quiet) {
+          TWELITE_ERROR(Cause_OVERMIND, id);  // unterminated macro args: {=i16}
+        }
+        return 0;
+      }
+    }
+
+    if (id < 0 || id >= MacroStore::NUM_MACROS) {
+      if (!quiet) {
+        TWELITE_ERROR(Cause_OVERMIND, id);  // macro call id out of range: {=i16}
+      }
+      return 0;
+    }
+
+    const uint8_t size =
+        g_macros.expand(id, args, num_args, expanded, MACRO_EXPAND_SIZE);
+    if (size == 0 && !quiet) {
+      TWELITE_ERROR(Cause_OVERMIND, id);  // empty or too long macro: {=i16}
+    }
+    return size;
+  }
+
+  // Adds number of actions per lane in the rest of the command (including
+  // macro bodies) to num_actions, without consuming or enqueuing anything.
+  // Malformed actions are counted as if they were accepted.
+  void count_actions(uint8_t* num_actions) {
+    const int saved_r_ix = r_ix;
+    while (true) {
+      if (consume('x')) {
+        // Nested macros are rejected by enqueue, so they're not counted.
+        if (!in_macro) {
+          count_macro_actions(num_actions);
+        }
+        skip_action();
+      } else {
+        num_actions[skip_action()]++;
+      }
+      if (!consume(',')) {
+        break;
+      }
+    }
+    r_ix = saved_r_ix;
+  }
+
+  // Expansion buffer is only in this frame (not in count_actions), so that
+  // it's on the stack only once.
+  void count_macro_actions(uint8_t* num_actions) {
+    uint8_t expanded[MACRO_EXPAND_SIZE];
+    const uint8_t size = read_macro_call(expanded, true);
+    if (size == 0) {
+      return;
+    }
+    const MaybeSlice outer = datagram;
+    const int outer_r_ix = r_ix;
+    datagram = MaybeSlice(expanded, size);
+    r_ix = 0;
+    in_macro = true;
+    count_actions(num_actions);
+    in_macro = false;
+    datagram = outer;
+    r_ix = outer_r_ix;
+  }
+
+  // Skips to the next ',' (or end), and returns lane of the skipped action.
+  uint8_t skip_action() {
+    uint8_t lane = LANE_LOCO;
+    while (true) {
+      const char c = peek();
+      if (c == 0 || c == ',') {
+        break;
+      }
+      read();
+      if (c == 'L') {
+        const int16_t v = parse_int();
+        lane = (v < 0) ? 0 : (v >= N_LANES) ? N_LANES - 1 : v;
+      }
+    }
+    return lane;
   }
 
   void enqueue_single_action() {
+    if (consume('x')) {
+      enqueue_macro();
+      return;
+    }
+    Action action = read_action();
+    g_actions.enqueue(action, shadow);
+  }
+
+  // Action in human readable format (w/o macro).
+  Action read_action() {
     int16_t dur_ms = parse_int();
     if (dur_ms < 1) {
+      TWELITE_ERROR(Cause_OVERMIND, dur_ms);  // dur capped to 1ms: {=i16}
       dur_ms = 1;
-      TWELITE_ERROR(Cause_OVERMIND);  // dur capped to 1ms
     } else if (dur_ms > 5000) {
+      TWELITE_ERROR(Cause_OVERMIND, dur_ms);  // dur capped to 5s: {=i16}
       dur_ms = 5000;
-      TWELITE_ERROR(Cause_OVERMIND);  // dur capped to 5s
     }
     Action action(dur_ms);
+    read_targets(action);
+    return action;
+  }
 
+  // (Target Value)+, until ',' or end.
+  void read_targets(Action& action) {
     while (true) {
       char target = read();
       switch (target) {
         case '!':
           // action.report = true;
           break;
-        case 'a':
-          action.servo_pos[CIX_A] = safe_read_pos();
-          break;
-        case 'b':
-          action.servo_pos[CIX_B] = safe_read_pos();
-          break;
-        case 't':
-          action.motor_vel[MV_TRAIN] = safe_read_vel();
-          break;
-        case 'o':
-          action.motor_vel[MV_ORI] = safe_read_vel();
-          break;
-        case 's':
-          action.motor_vel[MV_SCREW_DRIVER] = safe_read_vel();
-          break;
-        case 'T':
-          action.train_cutoff_thresh = safe_read_thresh();
+        case 'k':
+          read_spline(action);
           break;
         default:
-          TWELITE_ERROR(Cause_OVERMIND);  // unknown action target
+          if (!action.set_target(target, parse_int())) {
+            TWELITE_ERROR(Cause_OVERMIND, target);  // unknown action target: {=u8}
+          }
       }
 
       char next = peek();
@@ -230,57 +688,116 @@ class CommandHandler {
         break;
       }
     }
-    g_actions.enqueue(action);
   }
 
-  uint8_t safe_read_thresh() {
-    int16_t value = parse_int();
-    if (value < 0) {
-      value = 0;
-      TWELITE_ERROR(Cause_OVERMIND);  // too small value
-    } else if (value > 255) {
-      value = 255;
-      TWELITE_ERROR(Cause_OVERMIND);  // too big value
+  // (actuator) (t ':' value) (';' t ':' value)*
+  void read_spline(Action& action) {
+    if (action.spline_num_frames > 0) {
+      TWELITE_ERROR(Cause_OVERMIND);  // only one spline per action
+      return;
+    }
+    const char actuator = read();
+    uint8_t target;
+    int16_t v_min = -127;
+    int16_t v_max = 127;
+    switch (actuator) {
+      case 'A':
+      case 'B':
+        target = (actuator == 'A') ? CIX_A : CIX_B;
+        v_min = ServoPWM::MIN_PULSE_US;
+        v_max = ServoPWM::MAX_PULSE_US;
+        break;
+      case 't':
+        target = N_SERVOS + MV_TRAIN;
+        break;
+      case 'o':
+        target = N_SERVOS + MV_ORI;
+        break;
+      case 's':
+        target = N_SERVOS + MV_SCREW_DRIVER;
+        break;
+      default:
+        TWELITE_ERROR(Cause_OVERMIND, actuator);  // unknown spline actuator: {=u8}
+        return;
     }
-    return value;
-  }
 
-  uint8_t safe_read_pos() {
-    int16_t value = parse_int();
-    if (value < 10) {
-      value = 10;
-      TWELITE_ERROR(Cause_OVERMIND);  // too small pos
-    } else if (value > 33) {
-      // note: 255 is reserved as SERVO_POS_KEEP.
-      value = 33;
-      TWELITE_ERROR(Cause_OVERMIND);  // too big pos
+    Keyframe frames[Action::MAX_KEYFRAMES];
+    uint8_t n = 0;
+    do {
+      const int16_t t = parse_int();
+      if (!consume(':')) {
+        TWELITE_ERROR(Cause_OVERMIND, n);  // keyframe w/o value: {=u8}
+        return;
+      }
+      int16_t v = parse_int();
+      const int16_t t_prev = (n > 0) ? frames[n - 1].t_ms : 0;
+      if (t <= t_prev || t > (int16_t)action.duration_step) {
+        TWELITE_ERROR(Cause_OVERMIND, t);  // keyframe time out of order: {=i16}
+        return;
+      }
+      if (n >= Action::MAX_KEYFRAMES) {
+        TWELITE_ERROR(Cause_OVERMIND);  // too many keyframes
+        return;
+      }
+      if (v < v_min) {
+        TWELITE_ERROR(Cause_OVERMIND, v);  // too small keyframe: {=i16}
+        v = v_min;
+      } else if (v > v_max) {
+        TWELITE_ERROR(Cause_OVERMIND, v);  // too big keyframe: {=i16}
+        v = v_max;
+      }
+      frames[n].t_ms = t;
+      frames[n].value = v;
+      n++;
+    } while (consume(';'));
+
+    // Actions are always enqueued after parsing. If the action is rejected,
+    // keyframes are released by enqueue.
+    if (!g_actions.keyframes.alloc(frames, n, action.spline_begin)) {
+      TWELITE_ERROR(Cause_OVERMIND, n);  // keyframe pool full: {=u8}
+      return;
     }
-    return value;
+    action.spline_target = target;
+    action.spline_num_frames = n;
   }
 
-  int8_t safe_read_vel() {
+  uint16_t safe_read_limit() {
     int16_t value = parse_int();
-    if (value < -127) {
-      value = -127;
-      TWELITE_ERROR(Cause_OVERMIND);  // too small vel
-    } else if (value > 127) {
-      value = 127;
-      TWELITE_ERROR(Cause_OVERMIND);  // too big vel
+    if (value < 0) {
+      TWELITE_ERROR(Cause_OVERMIND, value);  // negative limit: {=i16}
+      value = 0;
     }
     return value;
   }
-
-  void fill_io_status(IOStatus& status) const {
-    fill_sensor_status(status.sensor);
-    g_actions.fill_output_status(status.output);
-  }
 };
 
 constexpr uint8_t IMU_POLL_CYCLE = 19;
 uint8_t imu_poll_index = 0;
 
 void loop1ms() {
+  // Run with interrupts enabled, so that servo pulse ISRs can preempt the
+  // tick. If the tick overruns, nested ticks are skipped (and counted).
+  static bool in_tick = false;
+  if (in_tick) {
+    if (g_num_skipped_ticks < 0xffff) {
+      g_num_skipped_ticks++;
+    }
+    return;
+  }
+  in_tick = true;
+  sei();
+
+  // Markers are counted by ADC ISR, so new ones reach 'P' stop checks in the
+  // same tick. Odometry part is as old as the last poll (IMU_POLL_CYCLE).
+  rail_position.update(odometry.get_rot(), sensor.edge_o.get_num_edges());
   g_actions.loop1ms();
+  if (g_actions.take_stop()) {
+    g_vm.stop();
+  }
+  if (!g_actions.is_held()) {
+    g_vm.loop1ms(g_actions);
+  }
+  indicator.loop1ms();
 
   uint16_t ttl_ms = g_async_sensor_ttl_ms;
   if (ttl_ms > 0) {
@@ -297,9 +814,14 @@ void loop1ms() {
   if (imu_poll_index >= IMU_POLL_CYCLE) {
     imu_poll_index = 0;
   }
+
+  cli();
+  in_tick = false;
 }
 
 int main() {
+  paint_stack();
+
   //// Minimum AVR & 3.3V (TWELITE) init.
   // Init arduino core things (e.g. Timer0).
   init();
@@ -316,38 +838,63 @@ int main() {
   I2c.pullup(0);  // we use external pullup registers
   I2c.timeOut(10);
 
+  // Start ADC sampling.
+  sensor.init();
+
   // Start 6-axis sensor.
   imu.init();
 
   // Start odometry magnetic sensor.
   odometry.init();
+  rail_position.init(odometry.get_rot(), sensor.edge_o.get_num_edges());
 
   indicator.flash_blocking();
   TWELITE_INFO();  // All HW initialized.
 
   g_actions.init();
+  // Needs Timer1, which is started by servos in g_actions.init().
+  {
+    const uint16_t cycles = odometry.benchmark_atan2();
+    TWELITE_INFO(cycles);  // odometry atan2 cycles: {=u16}
+    if (cycles > Odometry::ATAN2_CYCLE_BUDGET) {
+      TWELITE_ERROR(Cause_LOGIC, cycles);  // atan2 over budget: {=u16}
+    }
+  }
+  g_beacon.init(twelite.get_device_id());
   // Initialize servo pos to safe (i.e. not colliding with rail) position.
   {
     Action action(1 /* dur_ms */);
-    action.servo_pos[CIX_A] = 13;
-    action.servo_pos[CIX_B] = 11;
+    action.set_target('a', 13);
+    action.set_target('b', 11);
     g_actions.enqueue(action);
   }
 
   // Fully initialized. Start realtime periodic process & idle tasks.
   setMillisHook(loop1ms);
   while (true) {
-    if (g_twelite_packet_recv_done) {
+    if (twelite.is_recv_avail()) {
       MaybeSlice datagram = twelite.get_datagram();
       if (datagram.is_valid()) {
         CommandHandler command_handler(datagram);
         command_handler.handle();
       }
-      twelite.restart_recv();
+      twelite.pop_recv();
+    }
+    {
+      EmergencyAck ack;
+      if (g_actions.take_emergency_ack(ack)) {
+        uint8_t buffer[1 + sizeof(EmergencyAck)];
+        buffer[0] = PacketType_EMERGENCY_ACK;
+        memcpy(buffer + 1, &ack, sizeof(ack));
+        tx_scheduler.send(TX_SAFETY, buffer, sizeof(buffer));
+      }
     }
     if (g_async_message_avail) {
     }
-    if (g_async_sensor_ttl_ms > 0 && g_async_sensor_since_last_sent_ms > 100) {
+    const uint8_t telemetry_shift =
+        twelite.get_link_quality().get_telemetry_shift();
+    if (g_async_sensor_ttl_ms > 0 &&
+        g_async_sensor_since_last_sent_ms > (100U << telemetry_shift)) {
       IOStatus status;
       status.output = OutputStatus_init_default;
       fill_sensor_status(status.sensor);
@@ -357,12 +904,27 @@ int main() {
       pb_ostream_t stream =
           pb_ostream_from_buffer((pb_byte_t*)(buffer + 1), sizeof(buffer) - 1);
       if (pb_encode(&stream, IOStatus_fields, &status)) {
-        twelite.send_datagram(buffer, 1 + stream.bytes_written);
+        tx_scheduler.send(TX_TELEMETRY, buffer, 1 + stream.bytes_written);
       } else {
-        TWELITE_ERROR(Cause_LOGIC_RT);
+        TWELITE_ERROR(Cause_LOGIC_RT);  // async IOStatus encode failed
       }
 
       g_async_sensor_since_last_sent_ms = 0;
     }
+    if (g_beacon.take_due(telemetry_shift)) {
+      BeaconDigest digest;
+      g_actions.fill_beacon(digest);
+      if (g_vm.is_running()) {
+        digest.flags |= BeaconDigest::FLAG_PROGRAM;
+      }
+      if (error_counters.is_severe()) {
+        digest.flags |= BeaconDigest::FLAG_SEVERE;
+      }
+      digest.num_error_total = error_counters.get_num_total();
+      Beacon::send(digest);
+    }
+    error_counters.flush_if_needed();
+    logger.flush_if_needed();
+    tx_scheduler.poll();
   }
 }
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stdint.h>
+
+// Position profile of one axis (e.g. servo pulse width), evaluated
+// incrementally (DDA), so that each step only takes a few additions.
+//
+// A profile is a chain of integrators (jerk -> acc -> vel -> pos), whose top
+// is driven by a piecewise-constant input of +1 / 0 / -1 "unit" per step.
+// The unit is calculated once at begin() as (distance / distance travelled
+// with unit = 1), and all values are kept as exact fractions sharing that
+// denominator. So the profile lands exactly on the target, never overshoots,
+// and no divide is needed per step.
+//
+// Ease in / out can be dropped to chain profiles without stopping in
+// between. Without ease in, the profile starts at its cruise velocity.
+class MotionProfile {
+ public:
+  enum Shape : uint8_t {
+    // Constant velocity.
+    SHAPE_LINEAR = 0,
+    // Constant acc in first 1/4, cruise, constant dec in last 1/4.
+    SHAPE_TRAPEZOID = 1,
+    // Constant jerk (S-curve). Acc in first 1/3, cruise, dec in last 1/3.
+    SHAPE_SCURVE = 2,
+    NUM_SHAPES = 3,
+  };
+
+ private:
+  // q + r / den, where 0 <= r < den.
+  struct Frac {
+    int16_t q;
+    uint32_t r;
+  };
+
+  static constexpr uint8_t MAX_ORDER = 3;
+
+  uint16_t pos_begin = 0;
+  bool negative = false;
+
+  // 1: LINEAR, 2: TRAPEZOID, 3: SCURVE
+  uint8_t order = 1;
+  // Phases [first_phase, num_phases) are executed. Skipped ease in phases
+  // only determine the initial state.
+  uint8_t first_phase = 0;
+  uint8_t num_phases = 0;
+  uint8_t phase = 0;
+  uint16_t phase_left = 0;
+
+  // Total steps and length of acc (TRAPEZOID) or jerk (SCURVE) phases.
+  uint16_t num_steps = 0;
+  uint16_t edge_steps = 0;
+
+  uint32_t den = 1;
+  Frac unit;
+  // [0]: pos, [1]: vel, [2]: acc (up to order). Relative to pos_begin.
+  Frac integ[MAX_ORDER];
+
+ public:
+  // Move from pos_begin to pos_end in num_steps (>= 1) step() calls.
+  // Shorter profiles fall back to simpler shapes, and so does a profile
+  // without both ease in and out (to LINEAR).
+  void begin(uint16_t pos_begin, uint16_t pos_end, uint16_t num_steps,
+             Shape shape, bool ease_in = true, bool ease_out = true) {
+    this->pos_begin = pos_begin;
+    this->negative = pos_end < pos_begin;
+    this->num_steps = (num_steps > 0) ? num_steps : 1;
+    if (!ease_in && !ease_out) {
+      shape = SHAPE_LINEAR;
+    }
+    if (shape == SHAPE_SCURVE && this->num_steps / 6 > 0) {
+      order = 3;
+      num_phases = 5;
+      edge_steps = this->num_steps / 6;
+    } else if (shape != SHAPE_LINEAR && this->num_steps / 4 > 0) {
+      order = 2;
+      num_phases = 3;
+      edge_steps = this->num_steps / 4;
+    } else {
+      order = 1;
+      num_phases = 1;
+      edge_steps = 0;
+    }
+    first_phase = 0;
+    if (order > 1) {
+      if (!ease_in) {
+        first_phase = order - 1;
+      }
+      if (!ease_out) {
+        num_phases -= order - 1;
+      }
+    }
+
+    int32_t init_vel;
+    int32_t init_acc;
+    den = unit_distance(init_vel, init_acc);
+    const uint16_t dist = negative ? pos_begin - pos_end : pos_end - pos_begin;
+    unit.q = dist / den;
+    unit.r = dist % den;
+    for (uint8_t i = 0; i < MAX_ORDER; i++) {
+      integ[i].q = 0;
+      integ[i].r = 0;
+    }
+    if (order > 1) {
+      integ[1] = mul(unit, init_vel);
+    }
+    if (order > 2) {
+      integ[2] = mul(unit, init_acc);
+    }
+    phase = first_phase;
+    phase_left = phase_len(phase);
+    skip_empty_phases();
+  }
+
+  void step() {
+    if (phase >= num_phases) {
+      return;
+    }
+    const int8_t drive = phase_drive(phase);
+    if (drive > 0) {
+      add(integ[order - 1], unit);
+    } else if (drive < 0) {
+      sub(integ[order - 1], unit);
+    }
+    for (int8_t i = order - 2; i >= 0; i--) {
+      add(integ[i], integ[i + 1]);
+    }
+    phase_left--;
+    skip_empty_phases();
+  }
+
+  uint16_t get_pos() const {
+    return negative ? pos_begin - integ[0].q : pos_begin + integ[0].q;
+  }
+
+ private:
+  void skip_empty_phases() {
+    while (phase_left == 0 && phase < num_phases) {
+      phase++;
+      phase_left = (phase < num_phases) ? phase_len(phase) : 0;
+    }
+  }
+
+  // Skipped phases also have edge_steps, but don't count in num_steps.
+  uint16_t phase_len(uint8_t ix) const {
+    const uint8_t num_edges = num_phases - first_phase - 1;
+    switch (order) {
+      case 3:
+        return (ix == 2) ? num_steps - num_edges * edge_steps : edge_steps;
+      case 2:
+        return (ix == 1) ? num_steps - num_edges * edge_steps : edge_steps;
+      default:
+        return num_steps;
+    }
+  }
+
+  int8_t phase_drive(uint8_t ix) const {
+    switch (order) {
+      case 3:
+        return (ix == 0 || ix == 4) ? 1 : ((ix == 2) ? 0 : -1);
+      case 2:
+        return (ix == 0) ? 1 : ((ix == 1) ? 0 : -1);
+      default:
+        return 1;
+    }
+  }
+
+  // Distance travelled when unit = 1, in closed form (per phase).
+  // Also returns vel & acc at the beginning of first_phase.
+  uint32_t unit_distance(int32_t& init_vel, int32_t& init_acc) const {
+    int32_t a = 0;
+    int32_t v = 0;
+    int32_t p = 0;
+    for (uint8_t ix = 0; ix < num_phases; ix++) {
+      if (ix == first_phase) {
+        init_vel = v;
+        init_acc = a;
+        p = 0;
+      }
+      const int32_t m = phase_len(ix);
+      const int32_t c = phase_drive(ix);
+      const int32_t tri = m * (m + 1) / 2;
+      switch (order) {
+        case 3:
+          p += m * v + a * tri + c * (tri * (m + 2) / 3);
+          v += m * a + c * tri;
+          a += c * m;
+          break;
+        case 2:
+          p += m * v + c * tri;
+          v += c * m;
+          break;
+        default:
+          p += c * m;
+      }
+    }
+    return (p > 0) ? p : 1;
+  }
+
+  // x * k, in O(log k) additions.
+  Frac mul(Frac x, uint32_t k) const {
+    Frac result{0, 0};
+    while (k > 0) {
+      if (k & 1) {
+        add(result, x);
+      }
+      k >>= 1;
+      if (k > 0) {
+        add(x, x);
+      }
+    }
+    return result;
+  }
+
+  void add(Frac& x, const Frac& y) const {
+    x.q += y.q;
+    x.r += y.r;
+    if (x.r >= den) {
+      x.r -= den;
+      x.q++;
+    }
+  }
+
+  void sub(Frac& x, const Frac& y) const {
+    x.q -= y.q;
+    if (x.r < y.r) {
+      x.r += den - y.r;
+      x.q--;
+    } else {
+      x.r -= y.r;
+    }
+  }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+// Acceleration & jerk limited velocity ramp of one DC motor, stepped every
+// 1ms tick. Velocity is tracked in 1/256 of motor velocity unit (-0x7f~0x7f).
+//
+// When jerk is limited, acceleration is eased out before reaching the target
+// (when acc^2 / (2 jerk) >= remaining velocity), so the ramp doesn't
+// overshoot.
+class MotorRamp {
+ public:
+  struct Limits {
+    // Max |acceleration|, in 1/256 velocity per ms. 0 means unlimited.
+    uint16_t max_acc;
+    // Max |jerk|, in 1/256 velocity per ms^2. 0 means unlimited.
+    uint16_t max_jerk;
+  };
+
+  // 0 -> full speed in 254ms, reaching max acc in 8ms.
+  static constexpr uint16_t DEFAULT_MAX_ACC = 128;
+  static constexpr uint16_t DEFAULT_MAX_JERK = 16;
+
+ private:
+  Limits limits{DEFAULT_MAX_ACC, DEFAULT_MAX_JERK};
+
+  static constexpr int16_t MAX_VEL = 127 * 256;
+
+  int16_t vel = 0;
+  int16_t acc = 0;
+
+ public:
+  void set_limits(const Limits& new_limits) {
+    const uint8_t sreg = SREG;
+    cli();
+    limits = new_limits;
+    SREG = sreg;
+  }
+
+  Limits get_limits() const {
+    const uint8_t sreg = SREG;
+    cli();
+    const Limits l = limits;
+    SREG = sreg;
+    return l;
+  }
+
+  // Stop immediately, bypassing limits (e.g. train stop conditions).
+  void stop_now() {
+    vel = 0;
+    acc = 0;
+  }
+
+  // Advance 1ms toward target, and return new output velocity.
+  int8_t step(int8_t target) {
+    const int16_t targ = static_cast<int16_t>(target) * 256;
+    const int32_t dv = static_cast<int32_t>(targ) - vel;
+    int32_t new_vel;
+    if (dv == 0) {
+      acc = 0;
+      return get_output();
+    } else if (limits.max_acc == 0) {
+      acc = 0;
+      new_vel = targ;
+    } else if (limits.max_jerk == 0) {
+      acc = clamp(dv, limits.max_acc);
+      new_vel = vel + acc;
+    } else {
+      const int32_t jerk = (dv > 0) ? limits.max_jerk : -limits.max_jerk;
+      const uint32_t dv_abs = (dv > 0) ? dv : -dv;
+      const bool toward = (dv > 0) == (acc > 0);
+      if (toward && static_cast<uint32_t>(static_cast<int32_t>(acc) * acc) >=
+                        2UL * limits.max_jerk * dv_abs) {
+        acc -= jerk;  // ease out
+      } else {
+        acc = clamp(acc + jerk, limits.max_acc);
+      }
+      new_vel = vel + acc;
+    }
+    if ((dv > 0) ? (new_vel >= targ) : (new_vel <= targ)) {
+      vel = targ;
+      acc = 0;
+    } else if (new_vel > MAX_VEL || new_vel < -MAX_VEL) {
+      // acc still pointing the old way (after retarget) can push vel past
+      // the range. Saturate rather than wrap around.
+      vel = (new_vel > 0) ? MAX_VEL : -MAX_VEL;
+      acc = 0;
+    } else {
+      vel = new_vel;
+    }
+    return get_output();
+  }
+
+  int8_t get_output() const { return vel / 256; }
+
+ private:
+  static int16_t clamp(int32_t v, uint16_t max_abs) {
+    const int32_t m = (max_abs > INT16_MAX) ? INT16_MAX : max_abs;
+    if (v > m) {
+      return m;
+    } else if (v < -m) {
+      return -m;
+    }
+    return v;
+  }
+};
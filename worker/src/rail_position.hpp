@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Fuses rail markers (absolute, but sparse) and odometry (continuous, but
+ * drifting) into rail position.
+ *
+ * Position unit is 1/256 of marker interval ("segment"). Markers give segment
+ * index, and odometry interpolates between markers. Odometry units per segment
+ * is calibrated online from odometry change between consecutive markers.
+ */
+class RailPositionEstimator {
+ public:
+  static constexpr int16_t UNITS_PER_SEGMENT = 256;
+
+ private:
+  // Initial guess of odometry rotation (1/256 rot) per segment.
+  static constexpr uint16_t DEFAULT_ODO_PER_SEGMENT = 512;
+
+  // Position is lost when this far away from the last marker.
+  static constexpr uint8_t CONFIDENCE_RANGE_SEGMENTS = 2;
+
+  int16_t segment = 0;
+  int16_t odo_at_marker = 0;
+  uint16_t odo_per_segment = DEFAULT_ODO_PER_SEGMENT;
+  bool marker_seen = false;
+
+  uint16_t last_num_markers = 0;
+  int16_t odo = 0;
+
+ public:
+  void init(int16_t odo_rot, uint16_t num_markers) {
+    odo = odo_rot;
+    odo_at_marker = odo_rot;
+    last_num_markers = num_markers;
+  }
+
+  // odo_rot: Odometry::get_rot()
+  // num_markers: Number of markers passed since reset (wraps around).
+  void update(int16_t odo_rot, uint16_t num_markers) {
+    odo = odo_rot;
+    const uint16_t new_markers = num_markers - last_num_markers;
+    last_num_markers = num_markers;
+    if (new_markers == 0) {
+      return;
+    }
+
+    // Markers don't tell direction, odometry does.
+    const int16_t delta = odo - odo_at_marker;
+    if (new_markers == 1 && marker_seen) {
+      calibrate(delta >= 0 ? delta : -delta);
+    }
+    const int16_t n = new_markers;
+    segment += (delta >= 0) ? n : -n;
+    odo_at_marker = odo;
+    marker_seen = true;
+  }
+
+  // Returns position in 1/256 segments. Wraps around at +-128 segments.
+  int16_t get_position() const {
+    const int16_t delta = odo - odo_at_marker;
+    int32_t frac =
+        (static_cast<int32_t>(delta) * UNITS_PER_SEGMENT) / odo_per_segment;
+    // Beyond that, we should have seen a marker.
+    if (frac >= UNITS_PER_SEGMENT) {
+      frac = UNITS_PER_SEGMENT - 1;
+    } else if (frac <= -UNITS_PER_SEGMENT) {
+      frac = -(UNITS_PER_SEGMENT - 1);
+    }
+    return segment * UNITS_PER_SEGMENT + static_cast<int16_t>(frac);
+  }
+
+  // 255: exactly on marker, 0: no idea (e.g. no marker seen since reset).
+  uint8_t get_confidence() const {
+    if (!marker_seen) {
+      return 0;
+    }
+    const int16_t delta = odo - odo_at_marker;
+    const uint32_t dist = (delta >= 0) ? delta : -delta;
+    const uint32_t loss =
+        (dist * 256) / (static_cast<uint32_t>(odo_per_segment) *
+                        CONFIDENCE_RANGE_SEGMENTS);
+    return (loss >= 255) ? 0 : 255 - loss;
+  }
+
+ private:
+  void calibrate(uint16_t measured) {
+    // Reject obviously wrong measurement (e.g. direction changed between
+    // markers, or missed marker).
+    if (measured < odo_per_segment / 2 || measured > odo_per_segment * 2) {
+      return;
+    }
+    // Exponential moving average with alpha=1/4.
+    odo_per_segment += (static_cast<int16_t>(measured - odo_per_segment)) / 4;
+  }
+};
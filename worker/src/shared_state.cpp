@@ -5,13 +5,49 @@ TweliteInterface twelite;
 IMU imu;
 DCMotor motor_screw(98);
 MultiplexedSensor sensor;
+ServoPWM servos;
 Odometry odometry;
+RailPositionEstimator rail_position;
 
-volatile bool g_twelite_packet_recv_done = false;
 volatile bool g_async_message_avail = false;
+volatile uint8_t g_emergency_op = 0;
+volatile uint32_t g_emergency_ticks = 0;
+volatile uint16_t g_num_skipped_ticks = 0;
 volatile uint16_t g_async_sensor_ttl_ms = 0;
 volatile uint16_t g_async_sensor_since_last_sent_ms = 0;
 
+// End of static data (.data + .bss), defined by the linker.
+extern "C" uint8_t __heap_start;
+
+namespace {
+
+constexpr uint8_t STACK_PAINT = 0xc5;
+// Bytes below SP left unpainted, for paint_stack() itself.
+constexpr uint8_t STACK_PAINT_MARGIN = 16;
+
+}  // namespace
+
+void paint_stack() {
+  uint8_t* const end = reinterpret_cast<uint8_t*>(SP) - STACK_PAINT_MARGIN;
+  for (uint8_t* p = &__heap_start; p < end; p++) {
+    *p = STACK_PAINT;
+  }
+}
+
+uint16_t get_stack_free() {
+  const uint8_t* p = &__heap_start;
+  while (p < reinterpret_cast<const uint8_t*>(RAMEND) && *p == STACK_PAINT) {
+    p++;
+  }
+  return p - &__heap_start;
+}
+
+ISR(ADC_vect) { sensor.on_conversion_complete(); }
+
+ISR(TIMER1_OVF_vect) { servos.on_frame_start(); }
+ISR(TIMER1_COMPA_vect) { servos.on_pulse_end_a(); }
+ISR(TIMER1_COMPB_vect) { servos.on_pulse_end_b(); }
+
 void set_5v_power(bool enabled) {
   const uint8_t EN5V = _BV(0);
 
@@ -28,18 +64,51 @@ void Indicator::flash_blocking() {
   PORTC |= _BV(PC0);
   delay(50);
   PORTC &= ~_BV(PC0);
-  apply_error();
 }
 
-void Indicator::enter_error() {
-  error = true;
-  apply_error();
-}
+void Indicator::flash() { play_oneshot(PATTERN_RX, PATTERN_RX_LEN); }
+
+void Indicator::enter_error() { background = PATTERN_SEVERE; }
+
+void Indicator::loop1ms() {
+  slot_ms++;
+  if (slot_ms < SLOT_MS) {
+    return;
+  }
+  slot_ms = 0;
+
+  // Errors are observed through counters, so that error sites (which can be
+  // in ISR) don't need to know about the indicator.
+  const uint16_t num_error = error_counters.get_num_total();
+  if (num_error != last_num_error) {
+    last_num_error = num_error;
+    play_oneshot(PATTERN_ERROR, PATTERN_ERROR_LEN);
+  }
+  if (error_counters.is_severe()) {
+    background = PATTERN_SEVERE;
+  }
+
+  bool on;
+  if (oneshot_len > 0) {
+    on = oneshot & 1;
+    oneshot >>= 1;
+    oneshot_len--;
+  } else {
+    on = (background >> background_ix) & 1;
+  }
+  background_ix = (background_ix + 1) & 0xf;
 
-void Indicator::apply_error() {
-  if (error) {
+  if (on) {
     PORTC |= _BV(PC0);
   } else {
     PORTC &= ~_BV(PC0);
   }
 }
+
+void Indicator::play_oneshot(uint16_t pattern, uint8_t len) {
+  const uint8_t sreg = SREG;
+  cli();
+  oneshot = pattern;
+  oneshot_len = len;
+  SREG = sreg;
+}
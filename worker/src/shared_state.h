@@ -1,8 +1,8 @@
 #pragma once
 /* Hardware usage
- * Timer0: system clock
- * Timer1: action loop
- * Timer2: Servo PWM
+ * Timer0: system clock & action loop (millis hook)
+ * Timer1: Servo PWM (ServoPWM)
+ * ADC: MultiplexedSensor (interrupt driven)
  */
 
 #include "hardware_imu.hpp"
@@ -10,23 +10,54 @@
 #include "hardware_sensor.hpp"
 #include "hardware_twelite.h"
 #include "hardware_odometry.hpp"
+#include "hardware_servo.hpp"
+#include "rail_position.hpp"
 
 enum ServoIx : uint8_t { CIX_A, CIX_B, N_SERVOS };
 enum MotorIx : uint8_t { MV_TRAIN, MV_ORI, MV_SCREW_DRIVER, N_MOTORS };
 
 void set_5v_power(bool enabled);
 
+// Non-blocking LED pattern engine, driven by loop1ms().
+//
+// Patterns are bit sequences (LSB first), one bit per SLOT_MS. One-shot
+// patterns (RX, error) are played over the background pattern (off normally,
+// blinking slowly after severe error).
 class Indicator {
  private:
-  bool error;
+  static constexpr uint8_t SLOT_MS = 32;
+
+  static constexpr uint16_t PATTERN_RX = 0b11;
+  static constexpr uint8_t PATTERN_RX_LEN = 3;
+  static constexpr uint16_t PATTERN_ERROR = 0b11011;
+  static constexpr uint8_t PATTERN_ERROR_LEN = 6;
+  static constexpr uint16_t PATTERN_SEVERE = 0x00ff;
+
+  uint8_t slot_ms = 0;
+  uint8_t background_ix = 0;
+  uint16_t background = 0;
+
+  uint16_t oneshot = 0;
+  uint8_t oneshot_len = 0;
+
+  uint16_t last_num_error = 0;
 
  public:
   Indicator();
+
+  // Only for use before loop1ms starts (i.e. during boot).
   void flash_blocking();
+
+  // Show RX pattern once.
+  void flash();
+
+  // Keep showing severe error pattern until reset.
   void enter_error();
 
+  void loop1ms();
+
  private:
-  void apply_error();
+  void play_oneshot(uint16_t pattern, uint8_t len);
 };
 
 // Shared global hardware objects.
@@ -36,11 +67,38 @@ extern TweliteInterface twelite;
 extern IMU imu;
 extern DCMotor motor_screw;
 extern MultiplexedSensor sensor;
+extern ServoPWM servos;
 extern Odometry odometry;
+extern RailPositionEstimator rail_position;
 
 // Worker-wide shared status flags.
-extern volatile bool g_twelite_packet_recv_done;
 extern volatile bool g_async_message_avail;
 
+// Ops of CommandType_EMERGENCY.
+enum EmergencyOp : uint8_t {
+  // Remove all actions, stop motors & freeze servos.
+  EMERGENCY_STOP = 's',
+  // Remove queued actions, but let running ones finish.
+  EMERGENCY_CLEAR = 'c',
+  // Pause all lanes, stop motors & freeze servos.
+  EMERGENCY_HOLD = 'h',
+  EMERGENCY_RESUME = 'r',
+};
+
+// Pending EmergencyOp (0 if none), set by RX ISR and applied by the tick.
+extern volatile uint8_t g_emergency_op;
+// timer0_ticks() when g_emergency_op was set.
+extern volatile uint32_t g_emergency_ticks;
+
+// Stack headroom monitor. paint_stack() fills free RAM (between static data
+// and the stack) with a pattern; call it first in main(). get_stack_free()
+// returns how much of it was never overwritten, i.e. the worst case headroom
+// since reset.
+void paint_stack();
+uint16_t get_stack_free();
+
+// Ticks skipped because the previous one overran. Saturates at 0xffff.
+extern volatile uint16_t g_num_skipped_ticks;
+
 extern volatile uint16_t g_async_sensor_ttl_ms;
 extern volatile uint16_t g_async_sensor_since_last_sent_ms;
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdint.h>
+
+// Keyframe of a spline action. Time is relative to the action start.
+struct Keyframe {
+  uint16_t t_ms;
+  int16_t value;
+};
+
+// Keyframes shared by all queued actions, so that actions without keyframes
+// don't pay for them.
+//
+// Each action takes a contiguous run of frames. Actions in different lanes
+// finish in any order, so runs are tracked by a bitmap rather than as FIFO.
+class KeyframePool {
+ public:
+  static constexpr uint8_t SIZE = 16;
+
+ private:
+  Keyframe frames[SIZE];
+  // Bit i is set when frames[i] is in use.
+  volatile uint16_t used = 0;
+
+ public:
+  // Returns false (and allocates nothing) when there's not enough space.
+  bool alloc(const Keyframe* src, uint8_t n, uint8_t& begin) {
+    const uint16_t run = run_mask(n);
+    for (uint8_t b = 0; b + n <= SIZE; b++) {
+      // Concurrent release only clears bits, so this check stays valid.
+      if ((used & (run << b)) == 0) {
+        for (uint8_t i = 0; i < n; i++) {
+          frames[b + i] = src[i];
+        }
+        const uint8_t sreg = SREG;
+        cli();
+        used |= run << b;
+        SREG = sreg;
+        begin = b;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void release(uint8_t begin, uint8_t n) {
+    const uint8_t sreg = SREG;
+    cli();
+    used &= ~(run_mask(n) << begin);
+    SREG = sreg;
+  }
+
+  const Keyframe& at(uint8_t ix) const { return frames[ix]; }
+
+ private:
+  static uint16_t run_mask(uint8_t n) {
+    return (n >= 16) ? 0xffff : (1U << n) - 1;
+  }
+};
+
+// Piecewise cubic Hermite curve through keyframes, starting from (0,
+// value at action start). Evaluated in fixed point every tick.
+//
+// Tangents are 0 at both ends (ease in & out) and at local extrema, and
+// otherwise the average of adjacent secants, clamped to 3x the smaller secant
+// (Fritsch-Carlson). So the curve never overshoots keyframe values.
+class HermiteSpline {
+ private:
+  const KeyframePool* pool = nullptr;
+  uint8_t begin = 0;
+  uint8_t num_frames = 0;
+  int16_t value_start = 0;
+
+  // Current segment is from key(seg - 1) to key(seg). seg = 1..num_frames.
+  uint8_t seg = 0;
+  uint16_t t0 = 0;
+  uint16_t len = 1;
+  // 2^16 / len
+  uint32_t inv_len = 0;
+  int16_t p0 = 0;
+  int16_t p1 = 0;
+  // Tangents scaled by len (i.e. in value unit).
+  int32_t m0 = 0;
+  int32_t m1 = 0;
+  // Tangent at key(seg) in 1/256 value per ms, reused as next m0.
+  int32_t slope1 = 0;
+
+ public:
+  // Keyframes are not copied, and must be kept in the pool while in use.
+  void begin_curve(const KeyframePool& pool, uint8_t begin, uint8_t num_frames,
+                   int16_t value_start) {
+    this->pool = &pool;
+    this->begin = begin;
+    this->num_frames = num_frames;
+    this->value_start = value_start;
+    seg = 0;
+    slope1 = 0;
+    if (num_frames > 0) {
+      enter_segment(1);
+    }
+  }
+
+  uint8_t get_begin() const { return begin; }
+
+  uint8_t get_num_frames() const { return num_frames; }
+
+  int16_t eval(uint16_t t) {
+    if (num_frames == 0) {
+      return value_start;
+    }
+    while (seg < num_frames && t >= key(seg).t_ms) {
+      enter_segment(seg + 1);
+    }
+    if (t >= key(num_frames).t_ms) {
+      return key(num_frames).value;
+    }
+
+    // Hermite basis in Q16.
+    const uint32_t u = static_cast<uint32_t>(t - t0) * inv_len;
+    const uint32_t u2 = (u * u) >> 16;
+    const uint32_t u3 = (u2 * u) >> 16;
+    const int32_t h01 = 3 * u2 - 2 * u3;
+    const int32_t h10 = static_cast<int32_t>(u3 + u) - 2 * u2;
+    const int32_t h11 = static_cast<int32_t>(u3) - u2;
+    const int32_t dp = p1 - p0;
+    const int32_t v = (dp * h01 + m0 * h10 + m1 * h11) >> 16;
+    return p0 + v;
+  }
+
+ private:
+  // key(0) is the implicit start point.
+  Keyframe key(uint8_t k) const {
+    if (k == 0) {
+      return Keyframe{0, value_start};
+    }
+    return pool->at(begin + k - 1);
+  }
+
+  // Segments are entered in order, so the tangent at the start is the one
+  // at the end of the previous segment.
+  void enter_segment(uint8_t new_seg) {
+    const int32_t slope0 = slope1;
+    seg = new_seg;
+    const Keyframe k0 = key(seg - 1);
+    const Keyframe k1 = key(seg);
+    slope1 = slope_at(seg);
+    t0 = k0.t_ms;
+    len = (k1.t_ms > k0.t_ms) ? k1.t_ms - k0.t_ms : 1;
+    inv_len = 0x10000UL / len;
+    p0 = k0.value;
+    p1 = k1.value;
+    m0 = (slope0 * len) >> 8;
+    m1 = (slope1 * len) >> 8;
+  }
+
+  // Tangent at key(k), in 1/256 value per ms.
+  int32_t slope_at(uint8_t k) const {
+    if (k == 0 || k >= num_frames) {
+      return 0;
+    }
+    const int32_t sl = secant(key(k - 1), key(k));
+    const int32_t sr = secant(key(k), key(k + 1));
+    if ((sl > 0) != (sr > 0) || sl == 0 || sr == 0) {
+      return 0;  // local extremum
+    }
+    int32_t m = (sl + sr) / 2;
+    const int32_t al = (sl > 0) ? sl : -sl;
+    const int32_t ar = (sr > 0) ? sr : -sr;
+    const int32_t limit = 3 * ((al < ar) ? al : ar);
+    if (m > limit) {
+      m = limit;
+    } else if (m < -limit) {
+      m = -limit;
+    }
+    return m;
+  }
+
+  static int32_t secant(const Keyframe& a, const Keyframe& b) {
+    const uint16_t dt = (b.t_ms > a.t_ms) ? b.t_ms - a.t_ms : 1;
+    return (static_cast<int32_t>(b.value - a.value) * 256) / dt;
+  }
+};
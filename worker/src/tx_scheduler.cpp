@@ -0,0 +1,160 @@
+#include "tx_scheduler.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "logging.h"
+#include "shared_state.h"
+
+TxScheduler tx_scheduler;
+
+namespace {
+
+// Max number of queued packets per class.
+const uint8_t DEPTH[N_TX_CLASSES] = {1, 2, 1, 1, 1};
+
+}  // namespace
+
+TxScheduler::TxScheduler() {
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    slots[i].cls = N_TX_CLASSES;
+  }
+}
+
+void TxScheduler::send(TxClass cls, const uint8_t* ptr, uint8_t size) {
+  if (size > MAX_FRAME_SIZE) {
+    TWELITE_ERROR(Cause_LOGIC, size);  // tx packet too big: {=u8}
+    return;
+  }
+  if (is_clear(cls)) {
+    transmit(ptr, size);
+    return;
+  }
+
+  int8_t ix;
+  while ((ix = find_slot(cls)) < 0) {
+    if (cls == TX_TELEMETRY) {
+      add_saturating(num_dropped, 1);
+      return;
+    }
+    poll();
+  }
+  Slot& slot = slots[ix];
+  slot.cls = cls;
+  slot.order = next_order++;
+  slot.size = size;
+  memcpy(slot.data, ptr, size);
+}
+
+void TxScheduler::poll() {
+  update();
+  while (can_transmit()) {
+    const int8_t ix = find_next(N_TX_CLASSES);
+    if (ix < 0) {
+      break;
+    }
+    transmit(slots[ix].data, slots[ix].size);
+    slots[ix].cls = N_TX_CLASSES;
+  }
+}
+
+bool TxScheduler::is_clear(TxClass cls) {
+  update();
+  return can_transmit() && find_next(cls + 1) < 0;
+}
+
+void TxScheduler::update() {
+  uint8_t n_ok;
+  uint8_t n_fail;
+  twelite.take_tx_reports(n_ok, n_fail);
+  const uint16_t now = millis();
+
+  const uint16_t n = n_ok + n_fail;
+  if (n > 0) {
+    add_saturating(num_ok, n_ok);
+    add_saturating(num_fail, n_fail);
+    in_flight = (n >= in_flight) ? 0 : in_flight - n;
+    last_report_ms = now;
+    if (n_fail > 0) {
+      backing_off = true;
+      backoff_since_ms = now;
+    }
+  } else if (in_flight > 0 && static_cast<uint16_t>(now - last_report_ms) >=
+                                  REPORT_TIMEOUT_MS) {
+    in_flight--;
+    add_saturating(num_timeout, 1);
+    last_report_ms = now;
+  }
+
+  if (backing_off &&
+      static_cast<uint16_t>(now - backoff_since_ms) >= FAIL_BACKOFF_MS) {
+    backing_off = false;
+  }
+}
+
+int8_t TxScheduler::find_next(uint8_t max_cls) const {
+  int8_t best = -1;
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    const Slot& s = slots[i];
+    if (s.cls >= max_cls) {
+      continue;
+    }
+    if (best < 0 || s.cls < slots[best].cls ||
+        (s.cls == slots[best].cls &&
+         static_cast<int8_t>(s.order - slots[best].order) < 0)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+int8_t TxScheduler::find_slot(TxClass cls) {
+  if (count(cls) >= DEPTH[cls]) {
+    return (cls == TX_TELEMETRY) ? drop_oldest_telemetry() : -1;
+  }
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    if (slots[i].cls == N_TX_CLASSES) {
+      return i;
+    }
+  }
+  return (cls < TX_TELEMETRY) ? drop_oldest_telemetry() : -1;
+}
+
+int8_t TxScheduler::drop_oldest_telemetry() {
+  int8_t oldest = -1;
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    const Slot& s = slots[i];
+    if (s.cls == TX_TELEMETRY &&
+        (oldest < 0 ||
+         static_cast<int8_t>(s.order - slots[oldest].order) < 0)) {
+      oldest = i;
+    }
+  }
+  if (oldest >= 0) {
+    slots[oldest].cls = N_TX_CLASSES;
+    add_saturating(num_dropped, 1);
+  }
+  return oldest;
+}
+
+void TxScheduler::add_saturating(uint16_t& counter, uint16_t n) {
+  counter = (counter > 0xffff - n) ? 0xffff : counter + n;
+}
+
+uint8_t TxScheduler::count(TxClass cls) const {
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    if (slots[i].cls == cls) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void TxScheduler::transmit(const uint8_t* ptr, uint8_t size) {
+  if (in_flight == 0) {
+    last_report_ms = millis();
+  }
+  in_flight++;
+  twelite.send_datagram(ptr, size);
+}
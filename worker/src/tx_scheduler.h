@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+
+// Priority classes of outgoing packets. Lower value is sent first.
+enum TxClass : uint8_t {
+  // Acks that the host waits on for safety (EMERGENCY_ACK).
+  TX_SAFETY,
+  // Replies to commands (STATUS_REPORT, I2C_SCAN_RESULT, requested
+  // ERROR_COUNTERS).
+  TX_REPLY,
+  // LOG packets.
+  TX_EVENT,
+  // Periodic status (BEACON, async IO_STATUS). Only the latest one matters.
+  TX_TELEMETRY,
+  // Bulk diagnostics (periodic ERROR_COUNTERS).
+  TX_TRACE,
+  N_TX_CLASSES
+};
+
+// Sends packets in priority order, paced to what the TWELITE module can
+// absorb: at most MAX_IN_FLIGHT packets are in the module at once, and each
+// transmit result reported by the module frees one. When no result arrives
+// for REPORT_TIMEOUT_MS (e.g. module not reporting), the oldest one is
+// assumed done. After a failed transmit, sending pauses for FAIL_BACKOFF_MS.
+//
+// A packet is sent right away when the pacer allows and nothing of the same
+// or higher priority is queued. Otherwise it's copied to one of a few shared
+// slots (up to per-class depth), and sent by poll(). When there's no room,
+// TELEMETRY is dropped (queued one first, as newer one supersedes it); other
+// classes wait until a slot frees, so they're never lost.
+class TxScheduler {
+ public:
+  static constexpr uint8_t MAX_FRAME_SIZE = 80;
+  static constexpr uint8_t NUM_SLOTS = 2;
+
+  static constexpr uint8_t MAX_IN_FLIGHT = 3;
+  static constexpr uint8_t REPORT_TIMEOUT_MS = 50;
+  static constexpr uint8_t FAIL_BACKOFF_MS = 20;
+
+ private:
+  struct Slot {
+    // N_TX_CLASSES means empty.
+    uint8_t cls;
+    // Submission order, to keep FIFO within a class.
+    uint8_t order;
+    uint8_t size;
+    uint8_t data[MAX_FRAME_SIZE];
+  };
+
+  Slot slots[NUM_SLOTS];
+  uint8_t next_order = 0;
+
+  // Packets sent to the module, but not yet reported.
+  uint8_t in_flight = 0;
+  // millis() of the last transmit result (or first transmit since idle).
+  uint16_t last_report_ms = 0;
+  bool backing_off = false;
+  uint16_t backoff_since_ms = 0;
+
+  // Stats. Saturate at 0xffff.
+  // TELEMETRY packets dropped.
+  uint16_t num_dropped = 0;
+  // Transmit results reported by the module.
+  uint16_t num_ok = 0;
+  uint16_t num_fail = 0;
+  // Packets assumed done without result.
+  uint16_t num_timeout = 0;
+
+ public:
+  TxScheduler();
+
+  // Send or queue a packet (size <= MAX_FRAME_SIZE). Might block (polling)
+  // until a slot frees. Call from main loop only.
+  void send(TxClass cls, const uint8_t* ptr, uint8_t size);
+
+  // Send queued packets as credit allows. Call from main loop.
+  void poll();
+
+  // True when a packet of cls would be sent right away. Producers of
+  // TELEMETRY can use it to skip building packets that would be dropped.
+  bool is_clear(TxClass cls);
+
+  uint16_t get_num_dropped() const { return num_dropped; }
+  uint16_t get_num_ok() const { return num_ok; }
+  uint16_t get_num_fail() const { return num_fail; }
+  uint16_t get_num_timeout() const { return num_timeout; }
+
+ private:
+  // Take transmit results from the module, and update pacer state.
+  void update();
+
+  bool can_transmit() const {
+    return in_flight < MAX_IN_FLIGHT && !backing_off;
+  }
+
+  // Index of the slot to send next among classes < max_cls, or -1 if there's
+  // none.
+  int8_t find_next(uint8_t max_cls) const;
+
+  // Slot to queue a new packet of cls into (possibly by dropping queued
+  // TELEMETRY), or -1 if none.
+  int8_t find_slot(TxClass cls);
+
+  int8_t drop_oldest_telemetry();
+
+  static void add_saturating(uint16_t& counter, uint16_t n);
+
+  uint8_t count(TxClass cls) const;
+
+  void transmit(const uint8_t* ptr, uint8_t size);
+};
+
+extern TxScheduler tx_scheduler;
@@ -0,0 +1,71 @@
+// Host-side test of MotorRamp. Build & run with "scons test".
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// AVR stubs.
+static uint8_t SREG;
+static void cli() {}
+
+#include "../src/motor_ramp.hpp"
+
+static int num_failed = 0;
+
+#define EXPECT(cond, ...)                                   \
+  do {                                                      \
+    if (!(cond)) {                                          \
+      printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond); \
+      printf(__VA_ARGS__);                                  \
+      printf("\n");                                         \
+      num_failed++;                                         \
+    }                                                       \
+  } while (0)
+
+// Output must never jump by more than what one tick of max_acc allows.
+static void check_retarget(uint16_t max_acc, uint16_t max_jerk, int8_t from,
+                           int8_t to) {
+  MotorRamp ramp;
+  ramp.set_limits(MotorRamp::Limits{max_acc, max_jerk});
+  int8_t prev = 0;
+  // Retarget at every point of the ramp toward from, including while still
+  // accelerating.
+  for (int switch_at = 0; switch_at < 2000; switch_at += 7) {
+    ramp.stop_now();
+    prev = 0;
+    for (int t = 0; t < 8000; t++) {
+      const int8_t out = ramp.step(t < switch_at ? from : to);
+      const int step = abs(out - prev);
+      const int max_step = max_acc / 256 + 1;
+      EXPECT(step <= max_step,
+             "acc=%u jerk=%u %d->%d switch=%d t=%d: %d -> %d", max_acc,
+             max_jerk, from, to, switch_at, t, prev, out);
+      if (step > max_step) {
+        return;
+      }
+      prev = out;
+    }
+    EXPECT(prev == to, "acc=%u jerk=%u %d->%d: settled at %d", max_acc,
+           max_jerk, from, to, prev);
+  }
+}
+
+int main() {
+  const uint16_t accs[] = {16, 128, 240, 400, 1000};
+  const uint16_t jerks[] = {0, 1, 10, 16, 100};
+  const int8_t targets[] = {-127, -100, 0, 100, 127};
+  for (uint16_t acc : accs) {
+    for (uint16_t jerk : jerks) {
+      for (int8_t from : targets) {
+        for (int8_t to : targets) {
+          check_retarget(acc, jerk, from, to);
+        }
+      }
+    }
+  }
+  if (num_failed > 0) {
+    printf("%d failure(s)\n", num_failed);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}